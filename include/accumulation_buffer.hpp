@@ -0,0 +1,224 @@
+#ifndef TR_INCLUDE_ACCUMULATION_BUFFER_H
+#define TR_INCLUDE_ACCUMULATION_BUFFER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base.hpp"
+#include "color.hpp"
+
+// Summed radiance and per-pixel sample counts of one frame. Buffers holding
+// disjoint sample ranges of the same frame can be merged and tone-mapped later.
+// The half buffer sums only odd-indexed samples; comparing it with the full sum
+// gives the per-pixel error estimate used by adaptive sampling. First-hit albedo,
+// normal and depth are summed alongside as feature buffers for the denoiser.
+//
+// The sample ranges say which samples the buffer holds. After adaptive sampling
+// a converged pixel holds only a prefix of them; the buffer is then marked
+// adaptive and the ranges bound every pixel's samples instead of listing them.
+class AccumulationBuffer {
+public:
+    using SampleRange = std::pair<uint32_t, uint32_t>;
+
+    AccumulationBuffer() : width_(0), height_(0), adaptive_(false) {}
+    AccumulationBuffer(int width, int height)
+        : width_(width), height_(height), adaptive_(false), radiance_(width * height), sample_counts_(width * height, 0),
+          half_radiance_(width * height), half_sample_counts_(width * height, 0),
+          albedo_(width * height), normal_(width * height), depth_(width * height, 0.0) {}
+
+    int Width() const { return width_; }
+    int Height() const { return height_; }
+
+    void AddSamples(int index, const Color3d &radiance, uint32_t count, const Color3d &half_radiance, uint32_t half_count) {
+        radiance_[index] += radiance;
+        sample_counts_[index] += count;
+        half_radiance_[index] += half_radiance;
+        half_sample_counts_[index] += half_count;
+    }
+
+    // reset to an empty frame of the same size, keeping the allocations
+    void Clear() {
+        std::fill(radiance_.begin(), radiance_.end(), Color3d());
+        std::fill(sample_counts_.begin(), sample_counts_.end(), 0);
+        std::fill(half_radiance_.begin(), half_radiance_.end(), Color3d());
+        std::fill(half_sample_counts_.begin(), half_sample_counts_.end(), 0);
+        std::fill(albedo_.begin(), albedo_.end(), Color3d());
+        std::fill(normal_.begin(), normal_.end(), Vector3d());
+        std::fill(depth_.begin(), depth_.end(), 0.0);
+        sample_ranges_.clear();
+        adaptive_ = false;
+    }
+
+    void AddFeatures(int index, const Color3d &albedo, const Vector3d &normal, double depth) {
+        albedo_[index] += albedo;
+        normal_[index] += normal;
+        depth_[index] += depth;
+    }
+
+    // Relative error of a pixel estimated from the difference between the full
+    // and the half buffer (Dammertz et al., "A Hierarchical Automatic Stopping
+    // Condition for Monte Carlo Global Illumination").
+    double PixelError(int index) const {
+        uint32_t count = sample_counts_[index];
+        uint32_t half_count = half_sample_counts_[index];
+        if (half_count == 0 || half_count == count) {
+            return infinity;
+        }
+        Color3d full = radiance_[index] / count;
+        Color3d half = half_radiance_[index] / half_count;
+        double diff = fabs(full.x() - half.x()) + fabs(full.y() - half.y()) + fabs(full.z() - half.z());
+        return diff / std::sqrt(full.x() + full.y() + full.z() + 1e-4);
+    }
+
+    // Record that samples [begin, end) of every pixel are contained in the buffer,
+    // or with every_pixel false, that pixels took none, some or all of them.
+    void AddSampleRange(uint32_t begin, uint32_t end, bool every_pixel = true) {
+        adaptive_ = adaptive_ || !every_pixel;
+        if (!sample_ranges_.empty() && sample_ranges_.back().second == begin) {
+            sample_ranges_.back().second = end;
+        } else {
+            sample_ranges_.emplace_back(begin, end);
+        }
+    }
+
+    bool Merge(const AccumulationBuffer &other);
+
+    bool Save(const std::string &filename) const;
+
+    bool Load(const std::string &filename);
+
+    void Write(std::ostream &os) const;
+
+    bool Read(std::istream &is);
+
+public:
+    int width_;
+    int height_;
+    // some pixels skipped samples inside the ranges
+    bool adaptive_;
+    std::vector<Color3d> radiance_;
+    std::vector<uint32_t> sample_counts_;
+    std::vector<Color3d> half_radiance_;
+    std::vector<uint32_t> half_sample_counts_;
+    std::vector<Color3d> albedo_;
+    std::vector<Vector3d> normal_;
+    std::vector<double> depth_;
+    std::vector<SampleRange> sample_ranges_;
+
+private:
+    static constexpr char kMagic[8] = {'T', 'R', 'A', 'C', 'C', 'U', 'M', '4'};
+};
+
+static_assert(sizeof(Color3d) == 3 * sizeof(double), "Color3d must be tightly packed");
+
+bool AccumulationBuffer::Merge(const AccumulationBuffer &other) {
+    if (other.width_ != width_ || other.height_ != height_) {
+        return false;
+    }
+    // Samples are seeded by index, so overlapping ranges would count the same
+    // sample twice. The ranges of adaptive buffers bound their samples, so
+    // disjoint ranges still rule that out.
+    for (const auto &lhs : sample_ranges_) {
+        for (const auto &rhs : other.sample_ranges_) {
+            if (lhs.first < rhs.second && rhs.first < lhs.second) {
+                return false;
+            }
+        }
+    }
+    for (size_t i = 0; i < radiance_.size(); ++i) {
+        AddSamples(i, other.radiance_[i], other.sample_counts_[i], other.half_radiance_[i], other.half_sample_counts_[i]);
+        AddFeatures(i, other.albedo_[i], other.normal_[i], other.depth_[i]);
+    }
+    sample_ranges_.insert(sample_ranges_.end(), other.sample_ranges_.begin(), other.sample_ranges_.end());
+    adaptive_ = adaptive_ || other.adaptive_;
+    return true;
+}
+
+// Layout: magic, width, height, adaptive flag, range count, ranges, radiance sums (double),
+// sample counts (uint32), the same two arrays for the half buffer, then the
+// albedo, normal and depth feature sums. Values are stored in native byte order.
+bool AccumulationBuffer::Save(const std::string &filename) const {
+    std::ofstream ofs(filename, std::ios::binary);
+    if (!ofs) {
+        return false;
+    }
+    Write(ofs);
+    return static_cast<bool>(ofs);
+}
+
+bool AccumulationBuffer::Load(const std::string &filename) {
+    std::ifstream ifs(filename, std::ios::binary);
+    return Read(ifs);
+}
+
+void AccumulationBuffer::Write(std::ostream &ofs) const {
+    int32_t header[3] = {width_, height_, adaptive_};
+    uint32_t num_ranges = sample_ranges_.size();
+    ofs.write(kMagic, sizeof(kMagic));
+    ofs.write(reinterpret_cast<const char *>(header), sizeof(header));
+    ofs.write(reinterpret_cast<const char *>(&num_ranges), sizeof(num_ranges));
+    for (const auto &range : sample_ranges_) {
+        uint32_t bounds[2] = {range.first, range.second};
+        ofs.write(reinterpret_cast<const char *>(bounds), sizeof(bounds));
+    }
+    ofs.write(reinterpret_cast<const char *>(radiance_.data()), radiance_.size() * sizeof(Color3d));
+    ofs.write(reinterpret_cast<const char *>(sample_counts_.data()), sample_counts_.size() * sizeof(uint32_t));
+    ofs.write(reinterpret_cast<const char *>(half_radiance_.data()), half_radiance_.size() * sizeof(Color3d));
+    ofs.write(reinterpret_cast<const char *>(half_sample_counts_.data()), half_sample_counts_.size() * sizeof(uint32_t));
+    ofs.write(reinterpret_cast<const char *>(albedo_.data()), albedo_.size() * sizeof(Color3d));
+    ofs.write(reinterpret_cast<const char *>(normal_.data()), normal_.size() * sizeof(Vector3d));
+    ofs.write(reinterpret_cast<const char *>(depth_.data()), depth_.size() * sizeof(double));
+}
+
+bool AccumulationBuffer::Read(std::istream &ifs) {
+    char magic[sizeof(kMagic)];
+    int32_t header[3];
+    uint32_t num_ranges = 0;
+    if (!ifs.read(magic, sizeof(magic)) || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+        return false;
+    }
+    if (!ifs.read(reinterpret_cast<char *>(header), sizeof(header)) || header[0] <= 0 || header[1] <= 0) {
+        return false;
+    }
+    if (!ifs.read(reinterpret_cast<char *>(&num_ranges), sizeof(num_ranges))) {
+        return false;
+    }
+
+    *this = AccumulationBuffer(header[0], header[1]);
+    adaptive_ = header[2] != 0;
+    for (uint32_t i = 0; i < num_ranges; ++i) {
+        uint32_t bounds[2];
+        if (!ifs.read(reinterpret_cast<char *>(bounds), sizeof(bounds))) {
+            return false;
+        }
+        AddSampleRange(bounds[0], bounds[1]);
+    }
+    ifs.read(reinterpret_cast<char *>(radiance_.data()), radiance_.size() * sizeof(Color3d));
+    ifs.read(reinterpret_cast<char *>(sample_counts_.data()), sample_counts_.size() * sizeof(uint32_t));
+    ifs.read(reinterpret_cast<char *>(half_radiance_.data()), half_radiance_.size() * sizeof(Color3d));
+    ifs.read(reinterpret_cast<char *>(half_sample_counts_.data()), half_sample_counts_.size() * sizeof(uint32_t));
+    ifs.read(reinterpret_cast<char *>(albedo_.data()), albedo_.size() * sizeof(Color3d));
+    ifs.read(reinterpret_cast<char *>(normal_.data()), normal_.size() * sizeof(Vector3d));
+    ifs.read(reinterpret_cast<char *>(depth_.data()), depth_.size() * sizeof(double));
+    return static_cast<bool>(ifs);
+}
+
+// Tone-map the buffer through WriteColor as a P3 image. Row 0 of the buffer is
+// the bottom of the frame, so rows are written in reverse.
+void WritePpm(std::ostream &os, const AccumulationBuffer &buffer) {
+    os << "P3\n"
+       << buffer.width_ << " " << buffer.height_ << "\n255\n";
+    for (int j = buffer.height_ - 1; j >= 0; --j) {
+        for (int i = 0; i < buffer.width_; ++i) {
+            int index = j * buffer.width_ + i;
+            WriteColor(os, buffer.radiance_[index], buffer.sample_counts_[index]);
+        }
+    }
+}
+
+#endif
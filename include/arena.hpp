@@ -0,0 +1,128 @@
+#ifndef TR_INCLUDE_ARENA_H
+#define TR_INCLUDE_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+// Monotonic allocator for scene data that lives as long as the scene. Objects
+// are carved out of large blocks one after another and never freed on their
+// own; the blocks go back to the system in one shot when the arena dies. The
+// blocks are mapped 2 MB aligned and marked for transparent huge pages where
+// the kernel supports them, so a traversal touching geometry all over the
+// scene needs far fewer TLB entries than with small scattered heap blocks.
+class Arena {
+public:
+    Arena() {}
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena() {
+        for (const auto &block : blocks_) {
+            ::munmap(block.first, block.second);
+        }
+    }
+
+    void *Allocate(size_t bytes, size_t alignment) {
+        uintptr_t begin = (reinterpret_cast<uintptr_t>(current_) + alignment - 1) & ~(alignment - 1);
+        if (!current_ || begin + bytes > reinterpret_cast<uintptr_t>(end_)) {
+            NewBlock(bytes + alignment);
+            begin = (reinterpret_cast<uintptr_t>(current_) + alignment - 1) & ~(alignment - 1);
+        }
+        current_ = reinterpret_cast<char *>(begin + bytes);
+        bytes_used_ += bytes;
+        return reinterpret_cast<void *>(begin);
+    }
+
+    // Construct a T in the arena. Its destructor never runs, so T must not
+    // own anything.
+    template <typename T, typename... Args>
+    T *New(Args &&...args) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    size_t BytesUsed() const { return bytes_used_; }
+
+private:
+    static const size_t kHugePageSize = size_t(2) << 20;
+
+    void NewBlock(size_t min_bytes) {
+        size_t size = (min_bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+        // over-map by one huge page and trim, leaving a 2 MB aligned block
+        size_t map_size = size + kHugePageSize;
+        void *map = ::mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        char *raw = static_cast<char *>(map);
+        char *aligned = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(raw) + kHugePageSize - 1) & ~(kHugePageSize - 1));
+        if (aligned > raw) {
+            ::munmap(raw, aligned - raw);
+        }
+        if (aligned + size < raw + map_size) {
+            ::munmap(aligned + size, raw + map_size - (aligned + size));
+        }
+#ifdef MADV_HUGEPAGE
+        ::madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+        blocks_.emplace_back(aligned, size);
+        current_ = aligned;
+        end_ = aligned + size;
+    }
+
+    std::vector<std::pair<char *, size_t>> blocks_;
+    char *current_ = nullptr;
+    char *end_ = nullptr;
+    size_t bytes_used_ = 0;
+};
+
+// Standard allocator over an Arena, so containers can keep their storage
+// there. Deallocation is a no-op; the memory returns with the arena. Without
+// an arena it falls back to the heap.
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    ArenaAllocator(Arena *arena = nullptr) : arena_(arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena_(other.arena_) {}
+
+    T *allocate(size_t n) {
+        if (arena_) {
+            return static_cast<T *>(arena_->Allocate(n * sizeof(T), alignof(T)));
+        }
+        return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+    }
+
+    void deallocate(T *p, size_t) {
+        if (!arena_) {
+            ::operator delete(p, std::align_val_t(alignof(T)));
+        }
+    }
+
+    Arena *arena_;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T> &lhs, const ArenaAllocator<U> &rhs) {
+    return lhs.arena_ == rhs.arena_;
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &lhs, const ArenaAllocator<U> &rhs) {
+    return lhs.arena_ != rhs.arena_;
+}
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef TR_INCLUDE_ASYNC_IMAGE_WRITER_H
+#define TR_INCLUDE_ASYNC_IMAGE_WRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "accumulation_buffer.hpp"
+#include "denoiser.hpp"
+#include "image_writer.hpp"
+
+// Background stage for batch and animation jobs: finished frames are queued and
+// denoised, encoded and written by a writer thread while the caller renders the
+// next frame. At most max_in_flight frames wait in the queue or are being
+// written; Submit blocks beyond that, and the written buffers are recycled
+// through AcquireBuffer, so memory stays at max_in_flight + 1 framebuffers.
+class AsyncImageWriter {
+public:
+    AsyncImageWriter(int max_in_flight = 2) : max_in_flight_(max_in_flight), in_flight_(0), stop_(false), failed_(false) {
+        thread_ = std::thread(&AsyncImageWriter::Run, this);
+    }
+
+    ~AsyncImageWriter() {
+        Finish();
+    }
+
+    // a cleared buffer, reusing one whose frame has already been written when possible
+    AccumulationBuffer AcquireBuffer(int width, int height);
+
+    void Submit(const std::string &filename, AccumulationBuffer &&buffer, ImageFormat format, bool denoise);
+
+    // Wait until every submitted frame is written and stop the writer thread.
+    // Returns false if any frame failed to write.
+    bool Finish();
+
+private:
+    struct Job {
+        std::string filename_;
+        AccumulationBuffer buffer_;
+        ImageFormat format_;
+        bool denoise_;
+    };
+
+    void Run();
+
+    int max_in_flight_;
+    int in_flight_;
+    bool stop_;
+    bool failed_;
+    std::deque<Job> queue_;
+    std::vector<AccumulationBuffer> free_buffers_;
+    std::mutex mutex_;
+    std::condition_variable queue_changed_;
+    std::thread thread_;
+};
+
+AccumulationBuffer AsyncImageWriter::AcquireBuffer(int width, int height) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!free_buffers_.empty()) {
+        AccumulationBuffer buffer = std::move(free_buffers_.back());
+        free_buffers_.pop_back();
+        if (buffer.width_ == width && buffer.height_ == height) {
+            lock.unlock();
+            buffer.Clear();
+            return buffer;
+        }
+    }
+    lock.unlock();
+    return AccumulationBuffer(width, height);
+}
+
+void AsyncImageWriter::Submit(const std::string &filename, AccumulationBuffer &&buffer, ImageFormat format, bool denoise) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    queue_changed_.wait(lock, [this]() { return in_flight_ < max_in_flight_; });
+    queue_.push_back({filename, std::move(buffer), format, denoise});
+    ++in_flight_;
+    queue_changed_.notify_all();
+}
+
+bool AsyncImageWriter::Finish() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        queue_changed_.notify_all();
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    return !failed_;
+}
+
+void AsyncImageWriter::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        queue_changed_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+        if (queue_.empty()) {
+            return;
+        }
+        Job job = std::move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+
+        if (job.denoise_) {
+            Denoiser().Denoise(job.buffer_);
+        }
+        bool written = WriteImageFile(job.filename_, job.buffer_, job.format_);
+        if (!written) {
+            std::cerr << "\nFailed to write " << job.filename_ << "\n";
+        }
+
+        lock.lock();
+        failed_ = failed_ || !written;
+        free_buffers_.emplace_back(std::move(job.buffer_));
+        --in_flight_;
+        queue_changed_.notify_all();
+    }
+}
+
+#endif
@@ -1,8 +1,10 @@
 #ifndef TR_INCLUDE_BASE_H
 #define TR_INCLUDE_BASE_H
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <memory>
 #include <random>
@@ -56,32 +58,152 @@ inline Vector3d UnitVec3d(const double &theta, const double &rho) {
     return Vector3d(sin_theta * cos_rho, sin_theta * sin_rho, cos_theta);
 }
 
-inline Vector3d TangentToWorld(const Vector3d &vec, const Vector3d &N) {
-    Vector3d B, C;
+inline void TangentFrame(const Vector3d &N, Vector3d &B, Vector3d &C) {
     if (fabs(N.x()) > fabs(N.y())) {
         C = Normalize(Vector3d(N.z(), 0.0, -N.x()));
     } else {
         C = Normalize(Vector3d(0.0, N.z(), -N.y()));
     }
     B = CrossProduct(C, N);
+}
+
+inline Vector3d TangentToWorld(const Vector3d &vec, const Vector3d &N) {
+    Vector3d B, C;
+    TangentFrame(N, B, C);
     return vec.x() * B + vec.y() * C + vec.z() * N;
 }
 
+inline Vector3d WorldToTangent(const Vector3d &vec, const Vector3d &N) {
+    Vector3d B, C;
+    TangentFrame(N, B, C);
+    return {DotProduct(vec, B), DotProduct(vec, C), DotProduct(vec, N)};
+}
+
+// Warps from uniform numbers in [0, 1)^2, as drawn by a Sampler
+
+inline Vector3d SampleUnitDisk(const Vector2d &u) {
+    double theta = 2 * pi * u.x();
+    double radius = sqrt(u.y());
+    return {radius * cos(theta), radius * sin(theta)};
+}
+
+inline Vector3d SampleUnitSphere(const Vector2d &u) {
+    double theta = 2 * pi * u.x();
+    double cosPhi = 2 * u.y() - 1;
+    double sinPhi = sqrt(1 - cosPhi * cosPhi);
+    return {sinPhi * cos(theta), sinPhi * sin(theta), cosPhi};
+}
+
+inline Vector3d SampleHemisphere(const Vector3d &normal, const Vector2d &u) {
+    Vector3d unit_vec3 = SampleUnitSphere(u);
+    return DotProduct(unit_vec3, normal) > 0 ? unit_vec3 : -unit_vec3;
+}
+
+// density cos(theta) / pi around the normal (Malley's method)
+inline Vector3d SampleCosineHemisphere(const Vector3d &normal, const Vector2d &u) {
+    Vector3d disk = SampleUnitDisk(u);
+    double z = sqrt(std::max(0.0, 1.0 - disk.x() * disk.x() - disk.y() * disk.y()));
+    return TangentToWorld(Vector3d(disk.x(), disk.y(), z), normal);
+}
+
+// solid angle of the spherical triangle with unit vertices a, b, c
+// (Van Oosterom and Strackee)
+inline double SphericalTriangleArea(const Vector3d &a, const Vector3d &b, const Vector3d &c) {
+    return fabs(2 * atan2(DotProduct(a, CrossProduct(b, c)), 1 + DotProduct(a, b) + DotProduct(a, c) + DotProduct(b, c)));
+}
+
+// Direction uniform in the spherical triangle with unit vertices a, b, c
+// (Arvo, "Stratified Sampling of Spherical Triangles", 1995): u.x() picks the
+// sub-triangle area, which fixes a point c' on the arc from a to c, and u.y()
+// a point on the arc from b to c'.
+inline Vector3d SampleSphericalTriangle(const Vector3d &a, const Vector3d &b, const Vector3d &c, const Vector2d &u) {
+    // angle between unit vectors, accurate for nearly parallel ones too
+    auto angle_between = [](const Vector3d &v1, const Vector3d &v2) {
+        return DotProduct(v1, v2) < 0 ? pi - 2 * asin(std::min(1.0, Length(v1 + v2) / 2)) : 2 * asin(std::min(1.0, Length(v2 - v1) / 2));
+    };
+    Vector3d n_ab = Normalize(CrossProduct(a, b));
+    Vector3d n_bc = Normalize(CrossProduct(b, c));
+    Vector3d n_ca = Normalize(CrossProduct(c, a));
+    double alpha = angle_between(n_ab, -n_ca);
+    double beta = angle_between(n_bc, -n_ab);
+    double gamma = angle_between(n_ca, -n_bc);
+
+    // area of the sub-triangle a b c', plus pi
+    double area_pi = pi + u.x() * (alpha + beta + gamma - pi);
+    double cos_alpha = cos(alpha), sin_alpha = sin(alpha);
+    double sin_phi = sin(area_pi) * cos_alpha - cos(area_pi) * sin_alpha;
+    double cos_phi = cos(area_pi) * cos_alpha + sin(area_pi) * sin_alpha;
+    double k1 = cos_phi + cos_alpha;
+    double k2 = sin_phi - sin_alpha * DotProduct(a, b);
+    double cos_b = clamp((k2 + (k2 * cos_phi - k1 * sin_phi) * cos_alpha) / ((k2 * sin_phi + k1 * cos_phi) * sin_alpha), -1.0, 1.0);
+    double sin_b = sqrt(std::max(0.0, 1 - cos_b * cos_b));
+    Vector3d c_prime = cos_b * a + sin_b * Normalize(c - DotProduct(c, a) * a);
+
+    double cos_theta = 1 - u.y() * (1 - DotProduct(c_prime, b));
+    double sin_theta = sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+    return cos_theta * b + sin_theta * Normalize(c_prime - DotProduct(c_prime, b) * b);
+}
+
 // random function
 
 namespace TrRandom {
 
+// PCG32 generator (O'Neill, pcg-random.org). Small enough to reseed for every
+// sample, which keeps each pixel sample reproducible regardless of which thread
+// or which sample range renders it.
+class Pcg32 {
+public:
+    Pcg32() { Seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+
+    void Seed(uint64_t seed, uint64_t stream) {
+        state_ = 0;
+        increment_ = (stream << 1u) | 1u;
+        Next();
+        state_ += seed;
+        Next();
+    }
+
+    uint32_t Next() {
+        uint64_t old_state = state_;
+        state_ = old_state * 6364136223846793005ULL + increment_;
+        uint32_t xor_shifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+        uint32_t rot = static_cast<uint32_t>(old_state >> 59u);
+        return (xor_shifted >> rot) | (xor_shifted << ((-rot) & 31));
+    }
+
+private:
+    uint64_t state_;
+    uint64_t increment_;
+};
+
+inline Pcg32 &Generator() {
+    static thread_local Pcg32 generator;
+    return generator;
+}
+
+// splitmix64 finalizer, used to decorrelate neighbouring pixel indices
+inline uint64_t MixBits(uint64_t v) {
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ULL;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dULL;
+    v ^= v >> 33;
+    return v;
+}
+
+// Start the random stream of one pixel sample. Each sample index selects its own
+// PCG stream, so disjoint sample ranges draw statistically independent numbers.
+inline void SeedSample(uint64_t pixel_index, uint64_t sample_index) {
+    Generator().Seed(MixBits(pixel_index), sample_index);
+}
+
 inline double Double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return Generator().Next() * 0x1p-32;
 }
 
 inline double Double(const double &min, const double &max) {
     assert(min < max);
-    static std::uniform_real_distribution<double> distribution(min, max);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return min + (max - min) * Double();
 }
 
 inline Vector3d Vec3d() {
@@ -104,19 +226,15 @@ inline Vector3d random_vec3_in_unit_sphere() {
 */
 
 inline Vector3d UnitVec3d() {
-    double theta = 2 * pi * Double();
-    double cosPhi = 2 * Double() - 1;
-    double sinPhi = sqrt(1 - cosPhi * cosPhi);
-
-    return {sinPhi * cos(theta), sinPhi * sin(theta), cosPhi};
+    double u = Double();
+    return SampleUnitSphere(Vector2d(u, Double()));
 
     //return normalize(random_vec3_in_unit_sphere());
 }
 
 inline Vector3d Vec3InUnitDisk() {
-    double theta = 2 * pi * Double();
-    double radius = sqrt(Double());
-    return {radius * cos(theta), radius * sin(theta)};
+    double u = Double();
+    return SampleUnitDisk(Vector2d(u, Double()));
 }
 
 inline Vector3d UnitVec3InHemisphere(const Vector3d &normal) {
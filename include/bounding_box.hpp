@@ -17,7 +17,11 @@ public:
     const bool available() const { return min_ != max_; }
 
     bool Check(const Ray &r, double t_min, double t_max) const {
-        Vector3d inv = Inverse(r.direction());
+        return Check(r, Inverse(r.direction()), t_min, t_max);
+    }
+
+    // with the reciprocal of the ray direction precomputed once per ray
+    bool Check(const Ray &r, const Vector3d &inv, double t_min, double t_max) const {
         for (int i = 0; i < 3; ++i) {
             double t0 = (min_(i) - r.origin()(i)) * inv(i);
             double t1 = (max_(i) - r.origin()(i)) * inv(i);
@@ -37,6 +41,11 @@ public:
         return (min_ + max_) / 2.0;
     }
 
+    double SurfaceArea() const {
+        Vector3d d = max_ - min_;
+        return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+
 private:
     Point3d min_;
     Point3d max_;
@@ -2,6 +2,7 @@
 #define TR_INCLUDE_CAMERA_H
 
 #include "base.hpp"
+#include "sampler.hpp"
 
 class Camera {
 public:
@@ -36,8 +37,8 @@ public:
         lower_left_corner_ = view_pos - horizontal_ / 2 - vertical_ / 2 + focus_dist * w_;
     }
 
-    Ray GetRay(double s, double t) const {
-        Vector3d rd = lens_radius_ * TrRandom::Vec3InUnitDisk();
+    Ray GetRay(double s, double t, Sampler &sampler) const {
+        Vector3d rd = lens_radius_ * SampleUnitDisk(sampler.Get2D());
         Vector3d offset = rd.x() * u_ + rd.y() * v_;
 
         return Ray(view_pos_ + offset, lower_left_corner_ + s * horizontal_ + t * vertical_ - view_pos_ - offset);
@@ -0,0 +1,70 @@
+#ifndef TR_INCLUDE_CHECKPOINT_H
+#define TR_INCLUDE_CHECKPOINT_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "accumulation_buffer.hpp"
+#include "image_writer.hpp"
+
+// The settings a progressive render was started with and how far it got, saved
+// with the accumulation buffer so a killed run can resume. Every sample seeds its
+// random stream from its pixel and sample index, so there is no generator state
+// to save: continuing at next_sample_ draws exactly what the uninterrupted run
+// would have drawn.
+struct RenderCheckpoint {
+    int32_t sample_begin_ = 0;
+    int32_t sample_count_ = 0;
+    int32_t samples_per_pass_ = 0;
+    int32_t adaptive_min_samples_ = 0;
+    int32_t sampler_type_ = 0;
+    // keeps the doubles aligned without padding
+    int32_t reserved_ = 0;
+    double adaptive_threshold_ = 0.0;
+    double time_budget_seconds_ = 0.0;
+
+    int32_t passes_ = 0;
+    int32_t next_sample_ = 0;
+    // samples taken over all pixels, which adaptive sampling needs to split the budget
+    int64_t samples_spent_ = 0;
+    double seconds_ = 0.0;
+
+    bool SameSettings(const RenderCheckpoint &other) const {
+        return sample_begin_ == other.sample_begin_ && sample_count_ == other.sample_count_ &&
+               samples_per_pass_ == other.samples_per_pass_ && adaptive_min_samples_ == other.adaptive_min_samples_ &&
+               sampler_type_ == other.sampler_type_ &&
+               adaptive_threshold_ == other.adaptive_threshold_ && time_budget_seconds_ == other.time_budget_seconds_;
+    }
+};
+
+static_assert(sizeof(RenderCheckpoint) == 64, "RenderCheckpoint is stored as raw bytes and must not contain padding");
+
+const char checkpoint_magic[8] = {'T', 'R', 'C', 'K', 'P', 'T', '0', '3'};
+
+// Layout: magic, the RenderCheckpoint fields in native byte order, then the
+// accumulation buffer in its own file format. The file is replaced atomically,
+// so a crash while saving keeps the previous checkpoint.
+bool SaveCheckpoint(const std::string &filename, const RenderCheckpoint &checkpoint, const AccumulationBuffer &buffer) {
+    std::ostringstream oss(std::ios::binary);
+    oss.write(checkpoint_magic, sizeof(checkpoint_magic));
+    oss.write(reinterpret_cast<const char *>(&checkpoint), sizeof(checkpoint));
+    buffer.Write(oss);
+    return oss && WriteFileAtomically(filename, oss.str());
+}
+
+bool LoadCheckpoint(const std::string &filename, RenderCheckpoint &checkpoint, AccumulationBuffer &buffer) {
+    std::ifstream ifs(filename, std::ios::binary);
+    char magic[sizeof(checkpoint_magic)];
+    if (!ifs.read(magic, sizeof(magic)) || std::memcmp(magic, checkpoint_magic, sizeof(magic)) != 0) {
+        return false;
+    }
+    if (!ifs.read(reinterpret_cast<char *>(&checkpoint), sizeof(checkpoint))) {
+        return false;
+    }
+    return buffer.Read(ifs);
+}
+
+#endif
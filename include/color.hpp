@@ -2,17 +2,27 @@
 #define COLOR_H
 
 #include "base.hpp"
+#include <cstdint>
 #include <iostream>
 
-void WriteColor(std::ostream &os, Color3d pixel_color, int samples_per_pixel) {
-    double scale = 1.0 / samples_per_pixel;
-    pixel_color *= scale;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-    // gamma correction
+// Average the summed samples of a pixel. Pixels without any samples are black,
+// and a negative component (a broken estimate) is flagged with a yellow pixel.
+inline Color3d ResolveColor(Color3d pixel_color, int samples_per_pixel) {
+    double scale = samples_per_pixel > 0 ? 1.0 / samples_per_pixel : 0.0;
+    pixel_color *= scale;
     if (pixel_color.x() < 0 || pixel_color.y() < 0 || pixel_color.z() < 0) {
         pixel_color = {0.6, 0.6, 0};
     }
-    pixel_color = Sqrt(pixel_color);
+    return pixel_color;
+}
+
+void WriteColor(std::ostream &os, Color3d pixel_color, int samples_per_pixel) {
+    // gamma correction
+    pixel_color = Sqrt(ResolveColor(pixel_color, samples_per_pixel));
 
     // Write the translated [0,255] value of each color component.
     os << static_cast<int>(256 * clamp(pixel_color.x(), 0.0, 0.999)) << ' '
@@ -20,4 +30,27 @@ void WriteColor(std::ostream &os, Color3d pixel_color, int samples_per_pixel) {
        << static_cast<int>(256 * clamp(pixel_color.z(), 0.0, 0.999)) << '\n';
 }
 
-#endif
\ No newline at end of file
+// Gamma-correct and quantise resolved channel values to bytes, giving exactly
+// the values WriteColor prints. The SSE2 path works on doubles two at a time;
+// sqrt, min/max and the scale are all exact in IEEE arithmetic, so it matches
+// the scalar path bit for bit.
+inline void QuantizeChannels(const double *values, int count, uint8_t *out) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d upper = _mm_set1_pd(0.999);
+    const __m128d scale = _mm_set1_pd(256.0);
+    for (; i + 2 <= count; i += 2) {
+        __m128d v = _mm_sqrt_pd(_mm_loadu_pd(values + i));
+        v = _mm_mul_pd(scale, _mm_max_pd(_mm_min_pd(v, upper), zero));
+        __m128i q = _mm_cvttpd_epi32(v);
+        out[i] = static_cast<uint8_t>(_mm_cvtsi128_si32(q));
+        out[i + 1] = static_cast<uint8_t>(_mm_cvtsi128_si32(_mm_srli_si128(q, 4)));
+    }
+#endif
+    for (; i < count; ++i) {
+        out[i] = static_cast<uint8_t>(256 * clamp(std::sqrt(values[i]), 0.0, 0.999));
+    }
+}
+
+#endif
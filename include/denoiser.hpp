@@ -0,0 +1,280 @@
+#ifndef TR_INCLUDE_DENOISER_H
+#define TR_INCLUDE_DENOISER_H
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "accumulation_buffer.hpp"
+#include "base.hpp"
+#include "parallel.hpp"
+
+struct DenoiseSettings {
+    int iterations = 5;
+    // edge-stopping widths; the colour width halves with every iteration
+    float sigma_color = 1.0f;
+    float sigma_normal = 0.3f;
+    float sigma_albedo = 0.1f;
+    float sigma_depth = 0.05f; // relative to the centre pixel's depth
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al., "Edge-Avoiding A-Trous
+// Wavelet Transform for fast Global Illumination Filtering"). Colour is divided
+// by the first-hit albedo before filtering so texture and material edges survive,
+// and every tap is weighted by colour, normal, albedo and depth similarity.
+//
+// The image is held as padded float planes so each row is filtered four pixels
+// at a time with SSE, and rows are spread over the worker threads.
+class Denoiser {
+public:
+    Denoiser() {}
+    Denoiser(const DenoiseSettings &settings) : settings_(settings) {}
+
+    // Replace the buffer's radiance sums with denoised ones, keeping the sample
+    // counts so the result still tone-maps through WritePpm. Returns false and
+    // leaves the buffer alone if the settings ask for fewer than one iteration.
+    bool Denoise(AccumulationBuffer &buffer) const;
+
+private:
+    enum Plane { kColorR,
+                 kColorG,
+                 kColorB,
+                 kAlbedoR,
+                 kAlbedoG,
+                 kAlbedoB,
+                 kNormalX,
+                 kNormalY,
+                 kNormalZ,
+                 kDepth,
+                 kNumPlanes };
+
+    struct Planes {
+        int width_, height_, padding_, stride_;
+        std::array<std::vector<float>, kNumPlanes> data_;
+
+        // padding_ columns on the left, padding_ + 3 on the right, padding_ rows
+        // above and below
+        int Index(int x, int y) const { return (y + padding_) * stride_ + x + padding_; }
+    };
+
+    void FilterRow(const Planes &in, Planes &out, int y, int step, float sigma_color) const;
+
+    static void FillPadding(Planes &planes, int begin_plane, int end_plane);
+
+    DenoiseSettings settings_;
+};
+
+const float atrous_kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+#if defined(__SSE2__)
+// exp(x) for x <= 0 via 2^(x log2 e) with a degree-5 polynomial for the
+// fractional part; relative error is below 1e-6, plenty for filter weights.
+inline __m128 ExpNegative(__m128 x) {
+    x = _mm_max_ps(x, _mm_set1_ps(-80.0f));
+    __m128 t = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
+    __m128 ti = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+    ti = _mm_sub_ps(ti, _mm_and_ps(_mm_cmpgt_ps(ti, t), _mm_set1_ps(1.0f)));
+    __m128 f = _mm_sub_ps(t, ti);
+    __m128 p = _mm_set1_ps(1.333355814e-3f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.618129108e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.550410866e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.402265070e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.931471806e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+    __m128i exponent = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(ti), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(exponent));
+}
+#endif
+
+void Denoiser::FillPadding(Planes &planes, int begin_plane, int end_plane) {
+    // clamp-to-edge: replicate the outermost pixels into the padding
+    for (int plane = begin_plane; plane < end_plane; ++plane) {
+        std::vector<float> &data = planes.data_[plane];
+        for (int y = 0; y < planes.height_; ++y) {
+            float *row = &data[planes.Index(0, y)];
+            std::fill(row - planes.padding_, row, row[0]);
+            std::fill(row + planes.width_, row - planes.padding_ + planes.stride_, row[planes.width_ - 1]);
+        }
+        for (int y = -planes.padding_; y < 0; ++y) {
+            std::copy_n(&data[planes.Index(-planes.padding_, 0)], planes.stride_, &data[planes.Index(-planes.padding_, y)]);
+        }
+        for (int y = planes.height_; y < planes.height_ + planes.padding_; ++y) {
+            std::copy_n(&data[planes.Index(-planes.padding_, planes.height_ - 1)], planes.stride_, &data[planes.Index(-planes.padding_, y)]);
+        }
+    }
+}
+
+void Denoiser::FilterRow(const Planes &in, Planes &out, int y, int step, float sigma_color) const {
+    const float inv_color = 1.0f / (sigma_color * sigma_color);
+    const float inv_normal = 1.0f / (settings_.sigma_normal * settings_.sigma_normal);
+    const float inv_albedo = 1.0f / (settings_.sigma_albedo * settings_.sigma_albedo);
+    const float inv_depth = 1.0f / settings_.sigma_depth;
+    const float *plane[kNumPlanes];
+    for (int i = 0; i < kNumPlanes; ++i) {
+        plane[i] = in.data_[i].data();
+    }
+
+#if defined(__SSE2__)
+    const __m128 sign_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    // The last group may run up to three pixels past the row end. Its taps stay
+    // inside the row, whose right padding is three wider than the largest tap
+    // offset, and its stores land in padding that gets refilled afterwards.
+    for (int x = 0; x < in.width_; x += 4) {
+        int p = in.Index(x, y);
+        __m128 c[kNumPlanes];
+        for (int i = 0; i < kNumPlanes; ++i) {
+            c[i] = _mm_loadu_ps(plane[i] + p);
+        }
+        // colour distance is relative to the centre luminance, as noise grows with it
+        __m128 luminance = _mm_add_ps(_mm_add_ps(c[kColorR], c[kColorG]), c[kColorB]);
+        __m128 color_scale = _mm_div_ps(_mm_set1_ps(inv_color), _mm_add_ps(luminance, _mm_set1_ps(1e-2f)));
+        __m128 depth_scale = _mm_div_ps(_mm_set1_ps(inv_depth), _mm_add_ps(c[kDepth], _mm_set1_ps(1e-3f)));
+
+        __m128 sum_weight = _mm_setzero_ps();
+        __m128 sum_r = _mm_setzero_ps(), sum_g = _mm_setzero_ps(), sum_b = _mm_setzero_ps();
+        for (int dy = -2; dy <= 2; ++dy) {
+            for (int dx = -2; dx <= 2; ++dx) {
+                int q = p + dy * step * in.stride_ + dx * step;
+                __m128 d, dist;
+                __m128 r = _mm_loadu_ps(plane[kColorR] + q);
+                __m128 g = _mm_loadu_ps(plane[kColorG] + q);
+                __m128 b = _mm_loadu_ps(plane[kColorB] + q);
+                d = _mm_sub_ps(r, c[kColorR]);
+                dist = _mm_mul_ps(d, d);
+                d = _mm_sub_ps(g, c[kColorG]);
+                dist = _mm_add_ps(dist, _mm_mul_ps(d, d));
+                d = _mm_sub_ps(b, c[kColorB]);
+                dist = _mm_add_ps(dist, _mm_mul_ps(d, d));
+                __m128 exponent = _mm_mul_ps(dist, color_scale);
+
+                dist = _mm_setzero_ps();
+                for (int i = kNormalX; i <= kNormalZ; ++i) {
+                    d = _mm_sub_ps(_mm_loadu_ps(plane[i] + q), c[i]);
+                    dist = _mm_add_ps(dist, _mm_mul_ps(d, d));
+                }
+                exponent = _mm_add_ps(exponent, _mm_mul_ps(dist, _mm_set1_ps(inv_normal)));
+
+                dist = _mm_setzero_ps();
+                for (int i = kAlbedoR; i <= kAlbedoB; ++i) {
+                    d = _mm_sub_ps(_mm_loadu_ps(plane[i] + q), c[i]);
+                    dist = _mm_add_ps(dist, _mm_mul_ps(d, d));
+                }
+                exponent = _mm_add_ps(exponent, _mm_mul_ps(dist, _mm_set1_ps(inv_albedo)));
+
+                d = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(plane[kDepth] + q), c[kDepth]), sign_mask);
+                exponent = _mm_add_ps(exponent, _mm_mul_ps(d, depth_scale));
+
+                __m128 weight = _mm_mul_ps(_mm_set1_ps(atrous_kernel[dx + 2] * atrous_kernel[dy + 2]),
+                                           ExpNegative(_mm_sub_ps(_mm_setzero_ps(), exponent)));
+                sum_weight = _mm_add_ps(sum_weight, weight);
+                sum_r = _mm_add_ps(sum_r, _mm_mul_ps(weight, r));
+                sum_g = _mm_add_ps(sum_g, _mm_mul_ps(weight, g));
+                sum_b = _mm_add_ps(sum_b, _mm_mul_ps(weight, b));
+            }
+        }
+        // the centre tap always has weight 9/64, so the sum is never zero
+        __m128 inv_weight = _mm_div_ps(_mm_set1_ps(1.0f), sum_weight);
+        _mm_storeu_ps(&out.data_[kColorR][p], _mm_mul_ps(sum_r, inv_weight));
+        _mm_storeu_ps(&out.data_[kColorG][p], _mm_mul_ps(sum_g, inv_weight));
+        _mm_storeu_ps(&out.data_[kColorB][p], _mm_mul_ps(sum_b, inv_weight));
+    }
+#else
+    for (int x = 0; x < in.width_; ++x) {
+        int p = in.Index(x, y);
+        float luminance = plane[kColorR][p] + plane[kColorG][p] + plane[kColorB][p];
+        float color_scale = inv_color / (luminance + 1e-2f);
+        float depth_scale = inv_depth / (plane[kDepth][p] + 1e-3f);
+
+        float sum_weight = 0.0f, sum[3] = {0.0f, 0.0f, 0.0f};
+        for (int dy = -2; dy <= 2; ++dy) {
+            for (int dx = -2; dx <= 2; ++dx) {
+                int q = p + dy * step * in.stride_ + dx * step;
+                float color_dist = 0.0f, normal_dist = 0.0f, albedo_dist = 0.0f;
+                for (int i = 0; i < 3; ++i) {
+                    float dc = plane[kColorR + i][q] - plane[kColorR + i][p];
+                    float dn = plane[kNormalX + i][q] - plane[kNormalX + i][p];
+                    float da = plane[kAlbedoR + i][q] - plane[kAlbedoR + i][p];
+                    color_dist += dc * dc;
+                    normal_dist += dn * dn;
+                    albedo_dist += da * da;
+                }
+                float exponent = color_dist * color_scale + normal_dist * inv_normal + albedo_dist * inv_albedo +
+                                 std::fabs(plane[kDepth][q] - plane[kDepth][p]) * depth_scale;
+                float weight = atrous_kernel[dx + 2] * atrous_kernel[dy + 2] * std::exp(-exponent);
+                sum_weight += weight;
+                for (int i = 0; i < 3; ++i) {
+                    sum[i] += weight * plane[kColorR + i][q];
+                }
+            }
+        }
+        for (int i = 0; i < 3; ++i) {
+            out.data_[kColorR + i][p] = sum[i] / sum_weight;
+        }
+    }
+#endif
+}
+
+bool Denoiser::Denoise(AccumulationBuffer &buffer) const {
+    if (settings_.iterations < 1) {
+        return false;
+    }
+    Planes planes;
+    planes.width_ = buffer.width_;
+    planes.height_ = buffer.height_;
+    // the largest tap offset, two steps of the last iteration
+    planes.padding_ = 2 << (settings_.iterations - 1);
+    planes.stride_ = planes.width_ + 2 * planes.padding_ + 3;
+    for (auto &data : planes.data_) {
+        data.assign(static_cast<size_t>(planes.stride_) * (planes.height_ + 2 * planes.padding_), 0.0f);
+    }
+
+    // Average the sums and divide colour by albedo. Channels with (nearly) black
+    // albedo are left as they are and multiplied back by the same factor later.
+    auto albedo_factor = [](float albedo) { return albedo > 0.01f ? albedo : 1.0f; };
+    TrParallel::ParallelFor(planes.height_, [&](int y) {
+        for (int x = 0; x < planes.width_; ++x) {
+            int index = y * planes.width_ + x;
+            int p = planes.Index(x, y);
+            double scale = buffer.sample_counts_[index] > 0 ? 1.0 / buffer.sample_counts_[index] : 0.0;
+            for (int i = 0; i < 3; ++i) {
+                float albedo = buffer.albedo_[index](i) * scale;
+                planes.data_[kColorR + i][p] = buffer.radiance_[index](i) * scale / albedo_factor(albedo);
+                planes.data_[kAlbedoR + i][p] = albedo;
+                planes.data_[kNormalX + i][p] = buffer.normal_[index](i) * scale;
+            }
+            planes.data_[kDepth][p] = buffer.depth_[index] * scale;
+        }
+    });
+    FillPadding(planes, 0, kNumPlanes);
+
+    Planes filtered = planes;
+    float sigma_color = settings_.sigma_color;
+    for (int iteration = 0; iteration < settings_.iterations; ++iteration) {
+        int step = 1 << iteration;
+        TrParallel::ParallelFor(planes.height_, [&](int y) { FilterRow(planes, filtered, y, step, sigma_color); });
+        FillPadding(filtered, kColorR, kColorB + 1);
+        for (int i = kColorR; i <= kColorB; ++i) {
+            std::swap(planes.data_[i], filtered.data_[i]);
+        }
+        sigma_color *= 0.5f;
+    }
+
+    for (int y = 0; y < planes.height_; ++y) {
+        for (int x = 0; x < planes.width_; ++x) {
+            int index = y * planes.width_ + x;
+            int p = planes.Index(x, y);
+            uint32_t count = buffer.sample_counts_[index];
+            for (int i = 0; i < 3; ++i) {
+                double color = planes.data_[kColorR + i][p] * albedo_factor(planes.data_[kAlbedoR + i][p]);
+                buffer.radiance_[index](i) = std::max(color, 0.0) * count;
+            }
+        }
+    }
+    return true;
+}
+
+#endif
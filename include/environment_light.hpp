@@ -0,0 +1,208 @@
+#ifndef TR_INCLUDE_ENVIRONMENT_LIGHT_H
+#define TR_INCLUDE_ENVIRONMENT_LIGHT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "base.hpp"
+
+// Piecewise-constant density on [0, 1) proportional to n non-negative values,
+// sampled by inverting its CDF. An all-zero function is treated as uniform.
+class Distribution1D {
+public:
+    Distribution1D() {}
+    Distribution1D(const double *f, int n) : func_(f, f + n), cdf_(n + 1) {
+        cdf_[0] = 0.0;
+        for (int i = 0; i < n; ++i) {
+            cdf_[i + 1] = cdf_[i] + func_[i] / n;
+        }
+        integral_ = cdf_[n];
+        for (int i = 1; i <= n; ++i) {
+            cdf_[i] = integral_ > 0.0 ? cdf_[i] / integral_ : static_cast<double>(i) / n;
+        }
+    }
+
+    int Count() const { return static_cast<int>(func_.size()); }
+
+    double Integral() const { return integral_; }
+
+    // point in [0, 1) with density pdf; offset receives its segment
+    double Sample(double u, double &pdf, int &offset) const {
+        offset = static_cast<int>(std::upper_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin()) - 1;
+        offset = std::min(std::max(offset, 0), Count() - 1);
+        double du = u - cdf_[offset];
+        if (cdf_[offset + 1] > cdf_[offset]) {
+            du /= cdf_[offset + 1] - cdf_[offset];
+        }
+        pdf = Density(offset);
+        return std::min((offset + du) / Count(), 1.0 - 0x1p-53);
+    }
+
+    double Density(int offset) const {
+        return integral_ > 0.0 ? func_[offset] / integral_ : 1.0;
+    }
+
+private:
+    std::vector<double> func_;
+    std::vector<double> cdf_;
+    double integral_ = 0.0;
+};
+
+// Piecewise-constant density on [0, 1)^2 over a grid of nu x nv values: v is
+// drawn from the marginal density of the rows, then u from that row.
+class Distribution2D {
+public:
+    Distribution2D() {}
+    Distribution2D(const double *f, int nu, int nv) {
+        std::vector<double> marginal(nv);
+        for (int v = 0; v < nv; ++v) {
+            conditional_.emplace_back(f + static_cast<size_t>(v) * nu, nu);
+            marginal[v] = conditional_.back().Integral();
+        }
+        marginal_ = Distribution1D(marginal.data(), nv);
+    }
+
+    Vector2d Sample(const Vector2d &u, double &pdf) const {
+        double pdf_u, pdf_v;
+        int v_offset, u_offset;
+        double v = marginal_.Sample(u.y(), pdf_v, v_offset);
+        double x = conditional_[v_offset].Sample(u.x(), pdf_u, u_offset);
+        pdf = pdf_u * pdf_v;
+        return Vector2d(x, v);
+    }
+
+    double Pdf(const Vector2d &p) const {
+        int v = std::min(static_cast<int>(p.y() * marginal_.Count()), marginal_.Count() - 1);
+        int u = std::min(static_cast<int>(p.x() * conditional_[v].Count()), conditional_[v].Count() - 1);
+        return conditional_[v].Density(u) * marginal_.Density(v);
+    }
+
+private:
+    std::vector<Distribution1D> conditional_;
+    Distribution1D marginal_;
+};
+
+// Radiance arriving from infinitely far away, given by an equirectangular
+// (latitude-longitude) HDR image with +y up: u runs around the y axis, v from
+// +y at the top row to -y at the bottom. Directions are sampled in proportion
+// to texel brightness times the solid angle the texel covers.
+class EnvironmentLight {
+public:
+    EnvironmentLight() {}
+
+    // load a PFM image, scaling its radiance by scale
+    bool Load(const std::string &filename, double scale = 1.0);
+
+    bool Empty() const { return texels_.empty(); }
+
+    // radiance arriving along -dir, i.e. seen when looking towards dir
+    Color3d Emission(const Vector3d &dir) const;
+
+    // Direction towards the environment for u, with its solid-angle density.
+    // Returns the radiance from that direction.
+    Color3d Sample(const Vector2d &u, Vector3d &dir, double &pdf) const;
+
+    // solid-angle density with which Sample returns dir
+    double Pdf(const Vector3d &dir) const;
+
+private:
+    Vector2d DirectionToUv(const Vector3d &dir) const;
+
+    const Color3d &Texel(const Vector2d &uv) const {
+        int x = std::min(static_cast<int>(uv.x() * width_), width_ - 1);
+        int y = std::min(static_cast<int>(uv.y() * height_), height_ - 1);
+        return texels_[static_cast<size_t>(y) * width_ + x];
+    }
+
+    int width_ = 0;
+    int height_ = 0;
+    // top row first
+    std::vector<Color3d> texels_;
+    Distribution2D distribution_;
+};
+
+bool EnvironmentLight::Load(const std::string &filename, double scale) {
+    std::ifstream in(filename, std::ios::binary);
+    std::string magic;
+    int width = 0, height = 0;
+    double file_scale = 0.0;
+    if (!(in >> magic >> width >> height >> file_scale) || magic != "PF" || width <= 0 || height <= 0 || file_scale == 0.0) {
+        return false;
+    }
+    in.get();
+
+    std::vector<float> data(static_cast<size_t>(width) * height * 3);
+    if (!in.read(reinterpret_cast<char *>(data.data()), data.size() * sizeof(float))) {
+        return false;
+    }
+    // a negative scale marks little-endian data
+    uint16_t endian_probe = 1;
+    bool little_endian = *reinterpret_cast<uint8_t *>(&endian_probe) == 1;
+    if ((file_scale < 0.0) != little_endian) {
+        for (float &value : data) {
+            uint32_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            bits = (bits >> 24) | ((bits >> 8) & 0xff00u) | ((bits << 8) & 0xff0000u) | (bits << 24);
+            std::memcpy(&value, &bits, sizeof(bits));
+        }
+    }
+
+    width_ = width;
+    height_ = height;
+    texels_.resize(data.size() / 3);
+    std::vector<double> weights(texels_.size());
+    for (int y = 0; y < height_; ++y) {
+        // PFM rows run bottom to top
+        const float *row = &data[static_cast<size_t>(height_ - 1 - y) * width_ * 3];
+        double sin_theta = sin(pi * (y + 0.5) / height_);
+        for (int x = 0; x < width_; ++x) {
+            Color3d texel(row[x * 3], row[x * 3 + 1], row[x * 3 + 2]);
+            texels_[static_cast<size_t>(y) * width_ + x] = texel * scale;
+            weights[static_cast<size_t>(y) * width_ + x] = std::max(0.0, (texel.x() + texel.y() + texel.z()) / 3) * sin_theta;
+        }
+    }
+    distribution_ = Distribution2D(weights.data(), width_, height_);
+    return true;
+}
+
+Vector2d EnvironmentLight::DirectionToUv(const Vector3d &dir) const {
+    Vector3d w = Normalize(dir);
+    double phi = atan2(w.z(), w.x());
+    if (phi < 0.0) {
+        phi += 2 * pi;
+    }
+    return Vector2d(std::min(phi / (2 * pi), 1.0 - 0x1p-53), std::min(acos(clamp(w.y(), -1.0, 1.0)) / pi, 1.0 - 0x1p-53));
+}
+
+Color3d EnvironmentLight::Emission(const Vector3d &dir) const {
+    if (Empty()) {
+        return {0, 0, 0};
+    }
+    return Texel(DirectionToUv(dir));
+}
+
+Color3d EnvironmentLight::Sample(const Vector2d &u, Vector3d &dir, double &pdf) const {
+    double pdf_uv;
+    Vector2d uv = distribution_.Sample(u, pdf_uv);
+    double theta = uv.y() * pi, phi = uv.x() * 2 * pi;
+    double sin_theta = sin(theta);
+    dir = Vector3d(sin_theta * cos(phi), cos(theta), sin_theta * sin(phi));
+    // the map from uv to directions stretches area by 2 pi^2 sin(theta)
+    pdf = sin_theta > 0.0 ? pdf_uv / (2 * pi * pi * sin_theta) : 0.0;
+    return Texel(uv);
+}
+
+double EnvironmentLight::Pdf(const Vector3d &dir) const {
+    if (Empty()) {
+        return 0.0;
+    }
+    Vector2d uv = DirectionToUv(dir);
+    double sin_theta = sin(uv.y() * pi);
+    return sin_theta > 0.0 ? distribution_.Pdf(uv) / (2 * pi * pi * sin_theta) : 0.0;
+}
+
+#endif
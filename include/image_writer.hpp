@@ -0,0 +1,411 @@
+#ifndef TR_INCLUDE_IMAGE_WRITER_H
+#define TR_INCLUDE_IMAGE_WRITER_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "accumulation_buffer.hpp"
+#include "color.hpp"
+#include "parallel.hpp"
+
+// P3 is the text PPM written by WritePpm, P6 its binary form with the same
+// tone mapping, QOI the same 8-bit pixels losslessly compressed, and PFM stores
+// the linear averaged radiance as 32-bit floats.
+enum ImageFormat { kP3,
+                   kP6,
+                   kQOI,
+                   kPFM };
+
+bool ParseImageFormat(const std::string &name, ImageFormat &format) {
+    if (name == "p3") {
+        format = kP3;
+    } else if (name == "p6") {
+        format = kP6;
+    } else if (name == "qoi") {
+        format = kQOI;
+    } else if (name == "pfm") {
+        format = kPFM;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+ImageFormat ImageFormatFromFilename(const std::string &filename) {
+    auto ends_with = [&](const char *suffix) {
+        size_t len = std::strlen(suffix);
+        return filename.size() >= len && filename.compare(filename.size() - len, len, suffix) == 0;
+    };
+    if (ends_with(".pfm")) {
+        return kPFM;
+    }
+    return ends_with(".qoi") ? kQOI : kP6;
+}
+
+// Tone-map the frame into 8-bit RGB rows running top to bottom, the order both
+// P6 and QOI store them in. Rows are converted in parallel.
+void QuantizeImage(const AccumulationBuffer &buffer, uint8_t *pixels) {
+    int width = buffer.width_, height = buffer.height_;
+    TrParallel::ParallelFor(height, [&](int row) {
+        int j = height - 1 - row;
+        std::vector<double> resolved(width * 3);
+        for (int i = 0; i < width; ++i) {
+            int index = j * width + i;
+            Color3d color = ResolveColor(buffer.radiance_[index], buffer.sample_counts_[index]);
+            resolved[i * 3] = color.x();
+            resolved[i * 3 + 1] = color.y();
+            resolved[i * 3 + 2] = color.z();
+        }
+        QuantizeChannels(resolved.data(), width * 3, pixels + static_cast<size_t>(row) * width * 3);
+    });
+}
+
+// QOI ("Quite OK Image", qoiformat.org) encoder. The format is sequential, but
+// a decoder's state at any pixel is just the previous pixel and, per hash slot,
+// the last pixel that hashed there. Both can be derived for the start of every
+// strip up front, so strips are encoded independently on the worker threads
+// and concatenated into one valid stream.
+class QoiEncoder {
+public:
+    static std::string Encode(const std::vector<uint8_t> &pixels, int width, int height);
+
+private:
+    struct Pixel {
+        uint8_t r_, g_, b_, a_;
+
+        bool operator==(const Pixel &rhs) const { return r_ == rhs.r_ && g_ == rhs.g_ && b_ == rhs.b_ && a_ == rhs.a_; }
+        bool operator!=(const Pixel &rhs) const { return !(*this == rhs); }
+        int Hash() const { return (r_ * 3 + g_ * 5 + b_ * 7 + a_ * 11) % 64; }
+    };
+
+    struct State {
+        Pixel previous_;
+        std::array<Pixel, 64> index_;
+    };
+
+    static Pixel GetPixel(const std::vector<uint8_t> &pixels, size_t i) {
+        return {pixels[i * 3], pixels[i * 3 + 1], pixels[i * 3 + 2], 255};
+    }
+
+    static void EncodeStrip(const std::vector<uint8_t> &pixels, size_t begin, size_t end, State state, std::string &out);
+
+    static const int kRowsPerStrip = 16;
+};
+
+std::string QoiEncoder::Encode(const std::vector<uint8_t> &pixels, int width, int height) {
+    int num_strips = (height + kRowsPerStrip - 1) / kRowsPerStrip;
+    size_t strip_pixels = static_cast<size_t>(width) * kRowsPerStrip;
+    size_t num_pixels = static_cast<size_t>(width) * height;
+
+    // last pixel hashed to each slot inside every strip, found in parallel
+    std::vector<std::array<Pixel, 64>> strip_slots(num_strips);
+    std::vector<std::array<bool, 64>> strip_slot_used(num_strips);
+    TrParallel::ParallelFor(num_strips, [&](int strip) {
+        strip_slot_used[strip].fill(false);
+        for (size_t i = strip * strip_pixels; i < std::min(num_pixels, (strip + 1) * strip_pixels); ++i) {
+            Pixel px = GetPixel(pixels, i);
+            strip_slots[strip][px.Hash()] = px;
+            strip_slot_used[strip][px.Hash()] = true;
+        }
+    });
+
+    // decoder state at the start of every strip
+    std::vector<State> states(num_strips);
+    states[0].previous_ = {0, 0, 0, 255};
+    states[0].index_.fill({0, 0, 0, 0});
+    for (int strip = 1; strip < num_strips; ++strip) {
+        states[strip] = states[strip - 1];
+        states[strip].previous_ = GetPixel(pixels, strip * strip_pixels - 1);
+        for (int slot = 0; slot < 64; ++slot) {
+            if (strip_slot_used[strip - 1][slot]) {
+                states[strip].index_[slot] = strip_slots[strip - 1][slot];
+            }
+        }
+    }
+
+    std::vector<std::string> strips(num_strips);
+    TrParallel::ParallelFor(num_strips, [&](int strip) {
+        EncodeStrip(pixels, strip * strip_pixels, std::min(num_pixels, (strip + 1) * strip_pixels), states[strip], strips[strip]);
+    });
+
+    std::string image = "qoif";
+    for (uint32_t dim : {static_cast<uint32_t>(width), static_cast<uint32_t>(height)}) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            image.push_back(static_cast<char>((dim >> shift) & 0xff));
+        }
+    }
+    image.push_back(3); // RGB
+    image.push_back(0); // sRGB with linear alpha
+    size_t total = image.size() + 8;
+    for (const auto &strip : strips) {
+        total += strip.size();
+    }
+    image.reserve(total);
+    for (const auto &strip : strips) {
+        image += strip;
+    }
+    image.append(7, '\0');
+    image.push_back(1);
+    return image;
+}
+
+void QoiEncoder::EncodeStrip(const std::vector<uint8_t> &pixels, size_t begin, size_t end, State state, std::string &out) {
+    const uint8_t kOpIndex = 0x00, kOpDiff = 0x40, kOpLuma = 0x80, kOpRun = 0xc0, kOpRgb = 0xfe;
+
+    out.reserve((end - begin) * 2);
+    Pixel previous = state.previous_;
+    int run = 0;
+    for (size_t i = begin; i < end; ++i) {
+        Pixel px = GetPixel(pixels, i);
+        if (px == previous) {
+            // runs never continue into the next strip
+            if (++run == 62 || i + 1 == end) {
+                out.push_back(kOpRun | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out.push_back(kOpRun | (run - 1));
+            run = 0;
+        }
+
+        int slot = px.Hash();
+        if (state.index_[slot] == px) {
+            out.push_back(kOpIndex | slot);
+        } else {
+            state.index_[slot] = px;
+            int8_t dr = px.r_ - previous.r_;
+            int8_t dg = px.g_ - previous.g_;
+            int8_t db = px.b_ - previous.b_;
+            int8_t dr_dg = dr - dg;
+            int8_t db_dg = db - dg;
+            if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+                out.push_back(kOpDiff | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            } else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8) {
+                out.push_back(kOpLuma | (dg + 32));
+                out.push_back((dr_dg + 8) << 4 | (db_dg + 8));
+            } else {
+                out.push_back(kOpRgb);
+                out.push_back(px.r_);
+                out.push_back(px.g_);
+                out.push_back(px.b_);
+            }
+        }
+        previous = px;
+    }
+}
+
+// header of the fixed-size formats, P6 and PFM
+std::string ImageHeader(int width, int height, ImageFormat format) {
+    std::string size = std::to_string(width) + " " + std::to_string(height);
+    if (format == kP6) {
+        return "P6\n" + size + "\n255\n";
+    }
+    // a negative scale marks little-endian data
+    uint16_t endian_probe = 1;
+    bool little_endian = *reinterpret_cast<uint8_t *>(&endian_probe) == 1;
+    return "PF\n" + size + (little_endian ? "\n-1.0\n" : "\n1.0\n");
+}
+
+// Encode the whole frame into one contiguous block. Rows are converted in
+// parallel, each straight into its final position in the output.
+std::string EncodeImage(const AccumulationBuffer &buffer, ImageFormat format) {
+    int width = buffer.width_, height = buffer.height_;
+
+    if (format == kP3) {
+        std::ostringstream oss;
+        WritePpm(oss, buffer);
+        return oss.str();
+    }
+    if (format == kQOI) {
+        std::vector<uint8_t> pixels(static_cast<size_t>(width) * height * 3);
+        QuantizeImage(buffer, pixels.data());
+        return QoiEncoder::Encode(pixels, width, height);
+    }
+
+    std::string image;
+    std::string header = ImageHeader(width, height, format);
+    if (format == kP6) {
+        image.resize(header.size() + static_cast<size_t>(width) * height * 3);
+        std::memcpy(&image[0], header.data(), header.size());
+        QuantizeImage(buffer, reinterpret_cast<uint8_t *>(&image[header.size()]));
+    } else {
+        image.resize(header.size() + static_cast<size_t>(width) * height * 3 * sizeof(float));
+        std::memcpy(&image[0], header.data(), header.size());
+        char *pixels = &image[header.size()];
+
+        // PFM rows run bottom to top like the buffer
+        TrParallel::ParallelFor(height, [&](int j) {
+            std::vector<float> resolved(width * 3);
+            for (int i = 0; i < width; ++i) {
+                int index = j * width + i;
+                uint32_t count = buffer.sample_counts_[index];
+                double scale = count > 0 ? 1.0 / count : 0.0;
+                for (int c = 0; c < 3; ++c) {
+                    resolved[i * 3 + c] = static_cast<float>(buffer.radiance_[index](c) * scale);
+                }
+            }
+            std::memcpy(pixels + static_cast<size_t>(j) * width * 3 * sizeof(float), resolved.data(), resolved.size() * sizeof(float));
+        });
+    }
+    return image;
+}
+
+bool WriteImage(std::ostream &os, const AccumulationBuffer &buffer, ImageFormat format) {
+    std::string image = EncodeImage(buffer, format);
+    os.write(image.data(), image.size());
+    return static_cast<bool>(os);
+}
+
+// Write the data with a single write() to a temporary file, flush it to disk and
+// rename it into place, so readers polling the file never see a partial file and
+// a crash leaves either the old or the new contents.
+bool WriteFileAtomically(const std::string &filename, const std::string &data) {
+    std::string tmp_filename = filename + ".tmp";
+
+    int fd = ::open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n <= 0) {
+            ::close(fd);
+            return false;
+        }
+        written += n;
+    }
+    bool synced = ::fsync(fd) == 0;
+    if (::close(fd) != 0 || !synced) {
+        return false;
+    }
+    return std::rename(tmp_filename.c_str(), filename.c_str()) == 0;
+}
+
+bool WriteImageFile(const std::string &filename, const AccumulationBuffer &buffer, ImageFormat format) {
+    return WriteFileAtomically(filename, EncodeImage(buffer, format));
+}
+
+// Image file filled in band by band through short-lived memory maps, for frames
+// too large to hold in memory. Only P6 and PFM qualify, since their rows have a
+// fixed size and position. Bands may be written concurrently and in any order;
+// each maps just its own rows and unmaps them when done, so the process only
+// holds the bands in flight. The file appears under its name on Close.
+class MappedImageFile {
+public:
+    MappedImageFile() : fd_(-1), width_(0), height_(0), format_(kP6), header_size_(0) {}
+    MappedImageFile(const MappedImageFile &) = delete;
+    MappedImageFile &operator=(const MappedImageFile &) = delete;
+
+    ~MappedImageFile() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            std::remove(tmp_filename_.c_str());
+        }
+    }
+
+    bool Open(const std::string &filename, int width, int height, ImageFormat format);
+
+    // Store rows [row_begin, row_begin + row_count), counted bottom-up like the
+    // accumulation buffer, from the radiance sums of samples_per_pixel samples.
+    bool WriteRows(int row_begin, int row_count, const std::vector<Color3d> &radiance, uint32_t samples_per_pixel);
+
+    bool Close();
+
+private:
+    size_t RowBytes() const { return static_cast<size_t>(width_) * 3 * (format_ == kPFM ? sizeof(float) : 1); }
+
+    std::string filename_;
+    std::string tmp_filename_;
+    int fd_;
+    int width_;
+    int height_;
+    ImageFormat format_;
+    size_t header_size_;
+};
+
+bool MappedImageFile::Open(const std::string &filename, int width, int height, ImageFormat format) {
+    if (format != kP6 && format != kPFM) {
+        return false;
+    }
+    filename_ = filename;
+    tmp_filename_ = filename + ".tmp";
+    width_ = width;
+    height_ = height;
+    format_ = format;
+
+    std::string header = ImageHeader(width, height, format);
+    header_size_ = header.size();
+    fd_ = ::open(tmp_filename_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+        return false;
+    }
+    return ::ftruncate(fd_, header_size_ + RowBytes() * height) == 0 &&
+           ::pwrite(fd_, header.data(), header.size(), 0) == static_cast<ssize_t>(header.size());
+}
+
+bool MappedImageFile::WriteRows(int row_begin, int row_count, const std::vector<Color3d> &radiance, uint32_t samples_per_pixel) {
+    // P6 stores rows top-down, so the band's rows are reversed in the file
+    size_t row_bytes = RowBytes();
+    int first_file_row = format_ == kP6 ? height_ - row_begin - row_count : row_begin;
+    off_t begin = header_size_ + first_file_row * row_bytes;
+    off_t map_begin = begin & ~static_cast<off_t>(::sysconf(_SC_PAGESIZE) - 1);
+    size_t map_size = begin - map_begin + row_count * row_bytes;
+
+    void *map = ::mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, map_begin);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    char *rows = static_cast<char *>(map) + (begin - map_begin);
+    std::vector<double> resolved(width_ * 3);
+    for (int row = 0; row < row_count; ++row) {
+        const Color3d *sums = radiance.data() + static_cast<size_t>(row) * width_;
+        if (format_ == kP6) {
+            for (int i = 0; i < width_; ++i) {
+                Color3d color = ResolveColor(sums[i], samples_per_pixel);
+                resolved[i * 3] = color.x();
+                resolved[i * 3 + 1] = color.y();
+                resolved[i * 3 + 2] = color.z();
+            }
+            QuantizeChannels(resolved.data(), width_ * 3, reinterpret_cast<uint8_t *>(rows + (row_count - 1 - row) * row_bytes));
+        } else {
+            // the header leaves the floats unaligned
+            double scale = samples_per_pixel > 0 ? 1.0 / samples_per_pixel : 0.0;
+            std::vector<float> out(width_ * 3);
+            for (int i = 0; i < width_; ++i) {
+                for (int c = 0; c < 3; ++c) {
+                    out[i * 3 + c] = static_cast<float>(sums[i](c) * scale);
+                }
+            }
+            std::memcpy(rows + row * row_bytes, out.data(), row_bytes);
+        }
+    }
+    return ::munmap(map, map_size) == 0;
+}
+
+bool MappedImageFile::Close() {
+    if (fd_ < 0) {
+        return false;
+    }
+    int fd = fd_;
+    fd_ = -1;
+    if (::close(fd) != 0) {
+        std::remove(tmp_filename_.c_str());
+        return false;
+    }
+    return std::rename(tmp_filename_.c_str(), filename_.c_str()) == 0;
+}
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef TR_INCLUDE_LIGHT_BVH_H
+#define TR_INCLUDE_LIGHT_BVH_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "base.hpp"
+#include "bounding_box.hpp"
+#include "object.hpp"
+
+// Bounds of a group of emitters: where they are, the cone of normals they emit
+// around, and their total power. Importance estimates from these how much the
+// group can contribute to a shading point (Conty Estevez and Kulla, "Importance
+// Sampling of Many Lights with Adaptive Tree Splitting", 2018).
+struct LightBounds {
+    BoundingBox box_;
+    Vector3d axis_;
+    // cosine of the spread of the normals around axis_; emission itself falls
+    // off to zero a further pi/2 away
+    double cos_theta_o_ = 1.0;
+    double power_ = 0.0;
+
+    double Importance(const Point3d &p, const Vector3d &n) const;
+};
+
+LightBounds MergeLightBounds(const LightBounds &lhs, const LightBounds &rhs) {
+    if (lhs.power_ == 0.0) {
+        return rhs;
+    }
+    if (rhs.power_ == 0.0) {
+        return lhs;
+    }
+    LightBounds bounds;
+    bounds.box_ = MergeBoxes(lhs.box_, rhs.box_);
+    bounds.power_ = lhs.power_ + rhs.power_;
+
+    // smallest cone containing both cones
+    double theta_a = acos(clamp(lhs.cos_theta_o_, -1.0, 1.0));
+    double theta_b = acos(clamp(rhs.cos_theta_o_, -1.0, 1.0));
+    double theta_d = acos(clamp(DotProduct(lhs.axis_, rhs.axis_), -1.0, 1.0));
+    if (std::min(theta_d + theta_b, pi) <= theta_a) {
+        bounds.axis_ = lhs.axis_;
+        bounds.cos_theta_o_ = lhs.cos_theta_o_;
+        return bounds;
+    }
+    if (std::min(theta_d + theta_a, pi) <= theta_b) {
+        bounds.axis_ = rhs.axis_;
+        bounds.cos_theta_o_ = rhs.cos_theta_o_;
+        return bounds;
+    }
+    double theta_o = (theta_a + theta_d + theta_b) / 2;
+    Vector3d rotation_axis = CrossProduct(lhs.axis_, rhs.axis_);
+    if (theta_o >= pi || LengthSquared(rotation_axis) < eps) {
+        bounds.axis_ = lhs.axis_;
+        bounds.cos_theta_o_ = -1.0;
+        return bounds;
+    }
+    // rotate lhs.axis_ towards rhs.axis_ by theta_o - theta_a
+    double theta_r = theta_o - theta_a;
+    bounds.axis_ = Normalize(lhs.axis_ * cos(theta_r) + CrossProduct(Normalize(rotation_axis), lhs.axis_) * sin(theta_r));
+    bounds.cos_theta_o_ = cos(theta_o);
+    return bounds;
+}
+
+double LightBounds::Importance(const Point3d &p, const Vector3d &n) const {
+    // cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+    auto cos_sub_clamped = [](double sin_a, double cos_a, double sin_b, double cos_b) {
+        return cos_a > cos_b ? 1.0 : cos_a * cos_b + sin_a * sin_b;
+    };
+    auto sin_sub_clamped = [](double sin_a, double cos_a, double sin_b, double cos_b) {
+        return cos_a > cos_b ? 0.0 : sin_a * cos_b - cos_a * sin_b;
+    };
+    auto sin_from_cos = [](double cos) { return sqrt(std::max(0.0, 1 - cos * cos)); };
+
+    Point3d center = box_.Centroid();
+    double radius = Length(box_.max() - box_.min()) / 2;
+    double distance_sqr = std::max(LengthSquared(p - center), radius);
+
+    // angle between the cone axis and the direction to p, reduced by the cone
+    // spread and by the angle the bounds subtend from p
+    Vector3d w = Normalize(p - center);
+    double cos_w = DotProduct(axis_, w), sin_w = sin_from_cos(cos_w);
+    double cos_b = LengthSquared(p - center) < radius * radius ? -1.0 : sqrt(std::max(0.0, 1 - radius * radius / LengthSquared(p - center)));
+    double sin_b = sin_from_cos(cos_b);
+    double sin_o = sin_from_cos(cos_theta_o_);
+    double cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, cos_theta_o_);
+    double sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, cos_theta_o_);
+    double cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+    if (cos_p <= 0.0) {
+        return 0.0;
+    }
+
+    // the surface at p only reflects light arriving from above it
+    double cos_i = DotProduct(-w, n), sin_i = sin_from_cos(cos_i);
+    double cos_ip = cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+    return power_ * cos_p * std::max(0.0, cos_ip) / distance_sqr;
+}
+
+// Hierarchy over all emissive primitives, traversed stochastically: at each
+// node a child is chosen in proportion to its importance for the shading point,
+// so nearby, well-oriented and bright lights are picked more often than
+// distant or back-facing ones. Nodes are stored depth first, with the left
+// child right after its parent.
+class LightBvh {
+public:
+    LightBvh() {}
+
+    // emitters and their emitted radiance, one per primitive
+    LightBvh(const std::vector<const Object *> &lights, const std::vector<double> &radiance);
+
+    bool Empty() const { return nodes_.empty(); }
+
+    // Choose a light for the shading point p with normal n. u is a uniform
+    // number; pmf receives the probability of the choice.
+    const Object *Sample(const Point3d &p, const Vector3d &n, double u, double &pmf) const;
+
+    // probability that Sample chooses light for the shading point
+    double Pmf(const Point3d &p, const Vector3d &n, const Object *light) const;
+
+private:
+    struct Node {
+        LightBounds bounds_;
+        // second child for interior nodes, index into lights_ for leaves
+        int index_ = 0;
+        bool leaf_ = false;
+    };
+
+    int Build(std::vector<std::pair<const Object *, LightBounds>> &lights, size_t begin, size_t end, uint64_t trail, int depth);
+
+    std::vector<Node> nodes_;
+    std::vector<const Object *> lights_;
+    // path from the root to each light's leaf, one bit per level, set for the second child
+    std::unordered_map<const Object *, uint64_t> trails_;
+};
+
+LightBvh::LightBvh(const std::vector<const Object *> &lights, const std::vector<double> &radiance) {
+    std::vector<std::pair<const Object *, LightBounds>> bounded;
+    for (size_t i = 0; i < lights.size(); ++i) {
+        LightBounds bounds;
+        bounds.box_ = lights[i]->GetBoundingBox();
+        lights[i]->GetNormalCone(bounds.axis_, bounds.cos_theta_o_);
+        bounds.power_ = radiance[i] * lights[i]->GetArea();
+        if (bounds.power_ > 0.0) {
+            bounded.emplace_back(lights[i], bounds);
+        }
+    }
+    if (!bounded.empty()) {
+        Build(bounded, 0, bounded.size(), 0, 0);
+    }
+}
+
+int LightBvh::Build(std::vector<std::pair<const Object *, LightBounds>> &lights, size_t begin, size_t end, uint64_t trail, int depth) {
+    int node_index = static_cast<int>(nodes_.size());
+    nodes_.emplace_back();
+    // Median splits halve the lights at every level, so leaves sit at depth
+    // ceil(log2(count)) at most and every trail fits its 64 bits.
+    assert(depth < 64);
+    if (end - begin == 1) {
+        nodes_[node_index].bounds_ = lights[begin].second;
+        nodes_[node_index].leaf_ = true;
+        nodes_[node_index].index_ = static_cast<int>(lights_.size());
+        lights_.push_back(lights[begin].first);
+        trails_[lights[begin].first] = trail;
+        return node_index;
+    }
+
+    // split at the median centroid along the widest axis of the centroids
+    BoundingBox centroid_box(lights[begin].second.box_.Centroid());
+    for (size_t i = begin + 1; i < end; ++i) {
+        centroid_box = MergeBoxes(centroid_box, BoundingBox(lights[i].second.box_.Centroid()));
+    }
+    size_t axis = MaxDim(centroid_box);
+    size_t mid = begin + (end - begin) / 2;
+    std::nth_element(lights.begin() + begin, lights.begin() + mid, lights.begin() + end, [axis](const auto &a, const auto &b) {
+        return a.second.box_.Centroid()(axis) < b.second.box_.Centroid()(axis);
+    });
+
+    Build(lights, begin, mid, trail, depth + 1);
+    int second = Build(lights, mid, end, trail | (1ULL << depth), depth + 1);
+    nodes_[node_index].index_ = second;
+    nodes_[node_index].bounds_ = MergeLightBounds(nodes_[node_index + 1].bounds_, nodes_[second].bounds_);
+    return node_index;
+}
+
+const Object *LightBvh::Sample(const Point3d &p, const Vector3d &n, double u, double &pmf) const {
+    pmf = 0.0;
+    if (nodes_.empty()) {
+        return nullptr;
+    }
+    double probability = 1.0;
+    int node = 0;
+    while (!nodes_[node].leaf_) {
+        double first = nodes_[node + 1].bounds_.Importance(p, n);
+        double second = nodes_[nodes_[node].index_].bounds_.Importance(p, n);
+        if (first + second <= 0.0) {
+            return nullptr;
+        }
+        // reuse u for the next level by stretching the chosen interval to [0, 1)
+        double first_probability = first / (first + second);
+        if (u < first_probability) {
+            u = std::min(u / first_probability, 1.0 - 0x1p-53);
+            probability *= first_probability;
+            node = node + 1;
+        } else {
+            u = std::min((u - first_probability) / (1 - first_probability), 1.0 - 0x1p-53);
+            probability *= 1 - first_probability;
+            node = nodes_[node].index_;
+        }
+    }
+    pmf = probability;
+    return lights_[nodes_[node].index_];
+}
+
+double LightBvh::Pmf(const Point3d &p, const Vector3d &n, const Object *light) const {
+    auto found = trails_.find(light);
+    if (found == trails_.end()) {
+        return 0.0;
+    }
+    uint64_t trail = found->second;
+    double probability = 1.0;
+    int node = 0;
+    while (!nodes_[node].leaf_) {
+        double first = nodes_[node + 1].bounds_.Importance(p, n);
+        double second = nodes_[nodes_[node].index_].bounds_.Importance(p, n);
+        if (first + second <= 0.0) {
+            return 0.0;
+        }
+        if (trail & 1) {
+            probability *= second / (first + second);
+            node = nodes_[node].index_;
+        } else {
+            probability *= first / (first + second);
+            node = node + 1;
+        }
+        trail >>= 1;
+    }
+    return probability;
+}
+
+#endif
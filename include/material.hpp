@@ -1,47 +1,51 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
-#include "base.hpp"
-#include "object.hpp"
-
-class Material {
-public:
-    enum MaterialType { kDIFFUSE,
-                        kMICROFACET };
-
-    Material() {}
-    Material(MaterialType type, Vector3d kd, Vector3d ks, Vector3d ke, double ior, double roughness = 1.0, double metallic = 0.0)
-        : type_(type), k_diffuse_(kd), k_specular_(ks), k_emission_(ke), index_of_refraction_(ior), roughness_(roughness), metallic_(metallic) {}
-
-    bool HasEmission() const { return Length(k_emission_) > eps; }
-
-    Color3d GetEmission() const { return k_emission_; }
+#include <cstdint>
+#include <variant>
+#include <vector>
 
-    Vector3d Eval(const Vector3d &in_dir, const Vector3d &out_dir, const Vector3d &normal) const;
+#include "base.hpp"
+#include "sampler.hpp"
+
+// BSDF kernels. Each is a plain value type with the same three functions, held
+// in a std::variant by Material, so a call dispatches once on the variant index
+// and the kernel itself inlines. Directions point away from the surface: Eval
+// is the BRDF for light arriving along in_dir and leaving along out_dir, Sample
+// maps two uniform numbers to an in_dir for a given out_dir, and Pdf is the
+// solid-angle density of Sample returning in_dir.
+
+// Lambertian reflection, sampled by cosine.
+struct DiffuseBsdf {
+    Color3d albedo_;
+
+    Vector3d Eval(const Vector3d &in_dir, const Vector3d &out_dir, const Vector3d &normal) const {
+        if (DotProduct(in_dir, normal) <= 0.0 || DotProduct(out_dir, normal) <= 0.0) {
+            return {0, 0, 0};
+        }
+        return albedo_ / pi;
+    }
 
-    Vector3d Sample(const Vector3d &in_dir, const Vector3d &normal) const;
+    Vector3d Sample(const Vector3d &, const Vector3d &normal, Vector2d u) const {
+        return SampleCosineHemisphere(normal, u);
+    }
 
-    double Pdf(const Vector3d &in_dir, const Vector3d &out_dir, const Vector3d &normal) const;
+    double Pdf(const Vector3d &in_dir, const Vector3d &, const Vector3d &normal) const {
+        return std::max(0.0, DotProduct(in_dir, normal)) / pi;
+    }
+};
 
-private:
-    MaterialType type_;
-    Vector3d k_diffuse_;
-    Vector3d k_specular_;
-    Vector3d k_emission_;
+// Cook-Torrance GGX specular lobe over a diffuse base weighted by 1 - metallic.
+// The specular lobe samples visible normals, the diffuse lobe a cosine.
+struct MicrofacetBsdf {
+    Color3d albedo_;
     double index_of_refraction_;
-    double metallic_;
     double roughness_;
+    double metallic_;
 
-    static inline Vector3d reflect(const Vector3d &in_dir, const Vector3d &normal) {
-        return Normalize(in_dir - 2 * DotProduct(in_dir, normal) * normal);
-    }
-
-    static inline Vector3d refract(const Vector3d &in_dir, const Vector3d &normal, double refract_ratio) {
-        double cos_theta = DotProduct(in_dir, -normal);
-        Vector3d r_out_perp = refract_ratio * (in_dir + cos_theta * normal);
-        Vector3d r_out_vert = -std::sqrt(1 - LengthSquared(r_out_perp)) * normal;
-        return r_out_perp + r_out_vert;
-    }
+    Vector3d Eval(const Vector3d &in_dir, const Vector3d &out_dir, const Vector3d &normal) const;
+    Vector3d Sample(const Vector3d &out_dir, const Vector3d &normal, Vector2d u) const;
+    double Pdf(const Vector3d &in_dir, const Vector3d &out_dir, const Vector3d &normal) const;
 
     // schlick approximation
     static inline double reflectance(double cosine, double ref_idx) {
@@ -61,73 +65,165 @@ private:
         return roughness_sqr / (pi * x * x);
     }
 
+    // Smith masking for GGX in one direction, exact rather than the Schlick fit,
+    // so it cancels against the visible normal pdf
+    inline double SmithG1(const Vector3d &dir, const Vector3d &normal) const {
+        double cos_theta = DotProduct(dir, normal);
+        if (cos_theta <= 0.0) {
+            return 0.0;
+        }
+        double roughness_sqr = roughness_ * roughness_;
+        return 2 * cos_theta / (cos_theta + sqrt(roughness_sqr + (1 - roughness_sqr) * cos_theta * cos_theta));
+    }
+
     // Smith model for G
-    inline double SmithG(const Vector3d &in_dir, const Vector3d &out_dir, const Vector3d &m_dir) const {
-        double k = (roughness_ + 1) * (roughness_ + 1) / 8;
-        auto schlickGGX = [&](const Vector3d &n, const Vector3d &v) {
-            double n_dot_v = DotProduct(n, v);
-            return n_dot_v / (n_dot_v * (1 - k) + k);
-        };
-        return schlickGGX(in_dir, m_dir) * schlickGGX(out_dir, m_dir);
+    inline double SmithG(const Vector3d &in_dir, const Vector3d &out_dir, const Vector3d &normal) const {
+        return SmithG1(in_dir, normal) * SmithG1(out_dir, normal);
     }
+
+    // Chance of sampling the specular lobe rather than the diffuse one, from
+    // their estimated reflectance seen from out_dir. It depends only on out_dir,
+    // so Sample and Pdf agree on it.
+    inline double SpecularProbability(const Vector3d &out_dir, const Vector3d &normal) const {
+        double diffuse = (1 - metallic_) * (albedo_.x() + albedo_.y() + albedo_.z()) / 3;
+        double specular = reflectance(std::max(0.0, DotProduct(out_dir, normal)), index_of_refraction_);
+        return diffuse + specular > 0.0 ? specular / (diffuse + specular) : 1.0;
+    }
+
+    // Microfacet normal drawn from the GGX distribution of normals visible from
+    // out_dir (Heitz, "Sampling the GGX Distribution of Visible Normals", 2018).
+    Vector3d SampleVisibleNormal(const Vector3d &out_dir, const Vector3d &normal, const Vector2d &u) const;
 };
 
-Vector3d Material::Eval(const Vector3d &in_dir, const Vector3d &out_dir, const Vector3d &normal) const {
-    switch (type_) {
-    case kDIFFUSE: {
-        double cosTheta = DotProduct(normal, out_dir);
-        if (cosTheta > 0.0) {
-            return k_diffuse_ / pi;
-        }
+Vector3d MicrofacetBsdf::Eval(const Vector3d &in_dir, const Vector3d &out_dir, const Vector3d &normal) const {
+    double cos_in = DotProduct(in_dir, normal), cos_out = DotProduct(out_dir, normal);
+    if (cos_in <= 0.0 || cos_out <= 0.0) {
         return {0, 0, 0};
     }
-    case kMICROFACET: {
-        // Cook Torrance Microfacet Model
-        Vector3d m_dir = Normalize(in_dir + out_dir);
-        Vector3d F = Vector3d(1, 1, 1) * reflectance(DotProduct(in_dir, out_dir), index_of_refraction_);
-        double G = SmithG(in_dir, out_dir, m_dir);
-        double D = GGX(m_dir, normal);
-        return (1 - metallic_) * k_diffuse_ / pi + F * G * D / (4 * DotProduct(in_dir, normal) * DotProduct(out_dir, normal));
-    }
-    }
-    return {0, 0, 0};
+    // Cook Torrance Microfacet Model
+    Vector3d m_dir = Normalize(in_dir + out_dir);
+    Vector3d F = Vector3d(1, 1, 1) * reflectance(DotProduct(in_dir, m_dir), index_of_refraction_);
+    double G = SmithG(in_dir, out_dir, normal);
+    double D = GGX(m_dir, normal);
+    return (1 - metallic_) * albedo_ / pi + F * G * D / (4 * cos_in * cos_out);
 }
 
-Vector3d Material::Sample(const Vector3d &in_dir, const Vector3d &normal) const {
-    switch (type_) {
-    case kDIFFUSE: {
-        // For diffuse material, uniform sample on the hemisphere.
-        return TrRandom::UnitVec3InHemisphere(normal);
+Vector3d MicrofacetBsdf::Sample(const Vector3d &out_dir, const Vector3d &normal, Vector2d u) const {
+    // pick a lobe with u.x() and stretch the rest of it back to [0, 1)
+    double specular_probability = SpecularProbability(out_dir, normal);
+    if (u.x() < specular_probability) {
+        u.x() /= specular_probability;
+        Vector3d m_dir = SampleVisibleNormal(out_dir, normal, u);
+        return 2 * DotProduct(out_dir, m_dir) * m_dir - out_dir;
     }
-    case kMICROFACET: {
-        // reference to: https://agraphicsguy.wordpress.com/2015/11/01/sampling-microfacet-brdf/
-        double r = TrRandom::Double();
-        double rho = TrRandom::Double(0, pi / 2);
-        double theta = atan(roughness_ * sqrt(r / (1 - r)));
-        return TangentToWorld(UnitVec3d(theta, rho), normal);
+    u.x() = (u.x() - specular_probability) / (1 - specular_probability);
+    return SampleCosineHemisphere(normal, u);
+}
+
+double MicrofacetBsdf::Pdf(const Vector3d &in_dir, const Vector3d &out_dir, const Vector3d &normal) const {
+    double cos_in = DotProduct(in_dir, normal);
+    if (cos_in <= 0.0) {
+        return 0.0;
     }
+    // visible normal density G1(o) D(m) max(0, o.m) / (n.o), times the
+    // reflection Jacobian 1 / (4 o.m)
+    double cos_out = DotProduct(out_dir, normal);
+    double specular_pdf = 0.0;
+    if (cos_out > 0.0) {
+        Vector3d m_dir = Normalize(in_dir + out_dir);
+        specular_pdf = SmithG1(out_dir, normal) * GGX(m_dir, normal) / (4 * cos_out);
     }
-    return {0, 0, 0};
+    double specular_probability = SpecularProbability(out_dir, normal);
+    return specular_probability * specular_pdf + (1 - specular_probability) * cos_in / pi;
 }
 
-double Material::Pdf(const Vector3d &in_dir, const Vector3d &out_dir, const Vector3d &normal) const {
-    switch (type_) {
-    case kDIFFUSE: {
-        // For diffuse material, the probability equal to 1 / (2 * PI).
-        if (DotProduct(out_dir, normal) > 0.0) {
-            return 0.5 / pi;
+Vector3d MicrofacetBsdf::SampleVisibleNormal(const Vector3d &out_dir, const Vector3d &normal, const Vector2d &u) const {
+    // stretch the view direction to the hemisphere configuration
+    Vector3d v = WorldToTangent(out_dir, normal);
+    Vector3d vh = Normalize(Vector3d(roughness_ * v.x(), roughness_ * v.y(), v.z()));
+
+    // orthonormal basis around it
+    double length_sqr = vh.x() * vh.x() + vh.y() * vh.y();
+    Vector3d t1 = length_sqr > 0 ? Vector3d(-vh.y(), vh.x(), 0) / sqrt(length_sqr) : Vector3d(1, 0, 0);
+    Vector3d t2 = CrossProduct(vh, t1);
+
+    // uniform point on the projected half disk
+    double r = sqrt(u.x());
+    double phi = 2 * pi * u.y();
+    double p1 = r * cos(phi);
+    double p2 = r * sin(phi);
+    double s = 0.5 * (1 + vh.z());
+    p2 = (1 - s) * sqrt(1 - p1 * p1) + s * p2;
+
+    // reproject onto the hemisphere and unstretch
+    Vector3d nh = p1 * t1 + p2 * t2 + sqrt(std::max(0.0, 1 - p1 * p1 - p2 * p2)) * vh;
+    Vector3d m = Normalize(Vector3d(roughness_ * nh.x(), roughness_ * nh.y(), std::max(0.0, nh.z())));
+    return TangentToWorld(m, normal);
+}
+
+class Material {
+public:
+    enum MaterialType { kDIFFUSE,
+                        kMICROFACET };
+
+    using Bsdf = std::variant<DiffuseBsdf, MicrofacetBsdf>;
+
+    Material() {}
+    Material(MaterialType type, Vector3d kd, Vector3d ke, double ior, double roughness = 1.0, double metallic = 0.0)
+        : k_emission_(ke), has_emission_(Length(ke) > eps) {
+        if (type == kDIFFUSE) {
+            bsdf_ = DiffuseBsdf{kd};
         } else {
-            return 0.0;
+            bsdf_ = MicrofacetBsdf{kd, ior, roughness, metallic};
         }
     }
-    case kMICROFACET: {
-        Vector3d m_dir = Normalize(in_dir + out_dir);
-        return GGX(m_dir, normal);
+
+    bool HasEmission() const { return has_emission_; }
+
+    Color3d GetEmission() const { return k_emission_; }
+
+    Color3d GetAlbedo() const {
+        return std::visit([](const auto &bsdf) { return bsdf.albedo_; }, bsdf_);
     }
+
+    Vector3d Eval(const Vector3d &in_dir, const Vector3d &out_dir, const Vector3d &normal) const {
+        return std::visit([&](const auto &bsdf) { return bsdf.Eval(in_dir, out_dir, normal); }, bsdf_);
+    }
+
+    Vector3d Sample(const Vector3d &out_dir, const Vector3d &normal, Sampler &sampler) const {
+        Vector2d u = sampler.Get2D();
+        return std::visit([&](const auto &bsdf) { return bsdf.Sample(out_dir, normal, u); }, bsdf_);
     }
-    return 0;
-}
 
-using MaterialPtrType = shared_ptr<Material>;
+    double Pdf(const Vector3d &in_dir, const Vector3d &out_dir, const Vector3d &normal) const {
+        return std::visit([&](const auto &bsdf) { return bsdf.Pdf(in_dir, out_dir, normal); }, bsdf_);
+    }
+
+private:
+    Bsdf bsdf_;
+    Vector3d k_emission_;
+    bool has_emission_ = false;
+};
+
+// Index of a material in the scene's MaterialTable. Primitives and hits carry
+// this instead of a shared_ptr, so copying them never touches a reference count.
+using MaterialId = uint32_t;
+
+// All materials of a scene in one flat array, which also lets shading work be
+// grouped by material ID.
+class MaterialTable {
+public:
+    MaterialId Add(const Material &material) {
+        materials_.emplace_back(material);
+        return static_cast<MaterialId>(materials_.size() - 1);
+    }
+
+    const Material &operator[](MaterialId id) const { return materials_[id]; }
+
+    size_t Size() const { return materials_.size(); }
+
+private:
+    std::vector<Material> materials_;
+};
 
-#endif
\ No newline at end of file
+#endif
@@ -4,8 +4,9 @@
 #include "base.hpp"
 #include "bounding_box.hpp"
 #include "material.hpp"
+#include "sampler.hpp"
 
-class Material;
+class Object;
 
 class Intersection {
 public:
@@ -19,7 +20,9 @@ public:
     bool happened_;
     Point3d p_;
     Vector3d normal_;
-    shared_ptr<Material> material_;
+    MaterialId material_id_ = 0;
+    // the primitive hit, so emitter hits can be looked up in the light BVH
+    const Object *object_ = nullptr;
     double t_;
     bool front_face_;
 };
@@ -29,8 +32,31 @@ public:
     virtual Intersection Intersect(const Ray &r, double t_min, double t_max) const = 0;
     virtual BoundingBox GetBoundingBox() const = 0;
     virtual double GetArea() const = 0;
-    virtual void Sample(Intersection &inter, double &pdf) const = 0;
-    virtual MaterialPtrType GetMaterial() const = 0;
+    virtual void Sample(Intersection &inter, double &pdf, Sampler &sampler) const = 0;
+    virtual MaterialId GetMaterial() const = 0;
+
+    // Sample a point on the surface for lighting the point ref. pdf is still
+    // per unit area, whatever the primitive actually samples by.
+    virtual void Sample(const Point3d &, Intersection &inter, double &pdf, Sampler &sampler) const {
+        Sample(inter, pdf, sampler);
+    }
+
+    // area density with which Sample(ref, ...) returns the surface point p
+    virtual double Pdf(const Point3d &, const Point3d &) const {
+        return 1.0 / GetArea();
+    }
+
+    // Directions the surface emits into: normals within acos(cos_theta) of
+    // axis. The whole sphere unless a primitive knows better.
+    virtual void GetNormalCone(Vector3d &axis, double &cos_theta) const {
+        axis = Vector3d(0, 0, 1);
+        cos_theta = -1.0;
+    }
+
+    // the primitives this object is made of, each sampled as its own light
+    virtual void GetPrimitives(std::vector<const Object *> &primitives) const {
+        primitives.push_back(this);
+    }
 };
 
 using ObjectPtrType = std::shared_ptr<Object>;
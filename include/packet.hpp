@@ -0,0 +1,81 @@
+#ifndef TR_INCLUDE_PACKET_H
+#define TR_INCLUDE_PACKET_H
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "base.hpp"
+
+// Lanes per packet: as many single precision floats as fit in the widest
+// vector register the build targets, AVX or SSE. Without either the packet
+// test runs lane by lane.
+#if defined(__AVX__)
+const int kPacketWidth = 8;
+#else
+const int kPacketWidth = 4;
+#endif
+
+// A ray in single precision, set up once per traversal.
+struct PacketRay {
+    float origin_[3];
+    float direction_[3];
+
+    PacketRay() {}
+    PacketRay(const Ray &r) {
+        for (int k = 0; k < 3; ++k) {
+            origin_[k] = static_cast<float>(r.origin()(k));
+            direction_[k] = static_cast<float>(r.direction()(k));
+        }
+    }
+};
+
+#if defined(__SSE2__)
+
+// Arithmetic on PacketFloat uses the vector operators of GCC and Clang; the
+// rest goes through these.
+#if defined(__AVX__)
+typedef __m256 PacketFloat;
+inline PacketFloat PacketLoad(const float *p) { return _mm256_load_ps(p); }
+inline void PacketStore(float *p, PacketFloat a) { _mm256_store_ps(p, a); }
+inline PacketFloat PacketSet(float a) { return _mm256_set1_ps(a); }
+inline PacketFloat PacketAnd(PacketFloat a, PacketFloat b) { return _mm256_and_ps(a, b); }
+inline PacketFloat PacketGreater(PacketFloat a, PacketFloat b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+inline PacketFloat PacketGreaterEqual(PacketFloat a, PacketFloat b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+inline PacketFloat PacketSelect(PacketFloat mask, PacketFloat a, PacketFloat b) { return _mm256_blendv_ps(b, a, mask); }
+inline PacketFloat PacketSqrt(PacketFloat a) { return _mm256_sqrt_ps(a); }
+inline int PacketMask(PacketFloat a) { return _mm256_movemask_ps(a); }
+#else
+typedef __m128 PacketFloat;
+inline PacketFloat PacketLoad(const float *p) { return _mm_load_ps(p); }
+inline void PacketStore(float *p, PacketFloat a) { _mm_store_ps(p, a); }
+inline PacketFloat PacketSet(float a) { return _mm_set1_ps(a); }
+inline PacketFloat PacketAnd(PacketFloat a, PacketFloat b) { return _mm_and_ps(a, b); }
+inline PacketFloat PacketGreater(PacketFloat a, PacketFloat b) { return _mm_cmpgt_ps(a, b); }
+inline PacketFloat PacketGreaterEqual(PacketFloat a, PacketFloat b) { return _mm_cmpge_ps(a, b); }
+inline PacketFloat PacketSelect(PacketFloat mask, PacketFloat a, PacketFloat b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+inline PacketFloat PacketSqrt(PacketFloat a) { return _mm_sqrt_ps(a); }
+inline int PacketMask(PacketFloat a) { return _mm_movemask_ps(a); }
+#endif
+
+// Lane with the smallest t among those set in hit, or -1. Sets t_max to its t.
+inline int PacketNearest(PacketFloat hit, PacketFloat t, float &t_max) {
+    int mask = PacketMask(hit);
+    if (!mask) {
+        return -1;
+    }
+    alignas(32) float ts[kPacketWidth];
+    PacketStore(ts, t);
+    int nearest = -1;
+    for (int lane = 0; lane < kPacketWidth; ++lane) {
+        if ((mask >> lane & 1) && ts[lane] < t_max) {
+            t_max = ts[lane];
+            nearest = lane;
+        }
+    }
+    return nearest;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef TR_INCLUDE_PARALLEL_H
+#define TR_INCLUDE_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace TrParallel {
+
+// Workers ParallelFor may use, 0 for one per hardware thread. Setting 1 keeps
+// every loop on the calling thread.
+inline int &ThreadLimit() {
+    static int limit = 0;
+    return limit;
+}
+
+inline int ThreadCount() {
+    if (ThreadLimit() > 0) {
+        return ThreadLimit();
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Run func(index) for every index in [0, count), on ThreadCount() workers.
+// Workers pull indices from a shared counter, so uneven tasks balance themselves.
+template <typename Func>
+void ParallelFor(int count, const Func &func) {
+    std::atomic<int> next_index(0);
+    auto worker = [&]() {
+        for (int index = next_index++; index < count; index = next_index++) {
+            func(index);
+        }
+    };
+
+    int num_threads = std::min(ThreadCount(), count);
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &th : threads) {
+        th.join();
+    }
+}
+
+} // namespace TrParallel
+
+#endif
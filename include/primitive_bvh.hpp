@@ -0,0 +1,573 @@
+#ifndef TR_INCLUDE_PRIMITIVE_BVH_H
+#define TR_INCLUDE_PRIMITIVE_BVH_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <typeinfo>
+#include <vector>
+
+#include "arena.hpp"
+#include "base.hpp"
+#include "object.hpp"
+#include "object_list.hpp"
+#include "quad.hpp"
+#include "sphere.hpp"
+#include "sphere_packet.hpp"
+#include "traingle.hpp"
+#include "triangle_packet.hpp"
+
+namespace Bvh {
+
+// Scene-level BVH over the primitives of all objects, with meshes broken up
+// into their triangles. The primitives stay in the objects that hold them; the
+// tree lists them in one pointer array per type in the order the leaves visit
+// them, and each leaf covers a range of a single type, so a leaf test is a
+// tight loop of direct calls.
+// Types the tree does not know stay Objects behind a virtual call. Triangle
+// leaves are tested with the chosen TriangleIntersector; for kSIMD a leaf
+// holds up to kMaxPacketsPerLeaf TrianglePackets, and the cost model prices
+// a whole packet like one triangle test, so leaves grow to fill the lanes.
+// Sphere leaves are always SpherePackets. Quads are tested one by one.
+//
+// The tree is kept as QuantizedNodes, each holding the boxes of its two
+// children in 8 bit steps of its own box and leaves folded into their parent,
+// which takes about a third of the memory of a node per box in double.
+class PrimitiveBvh {
+public:
+    enum PrimitiveType : uint8_t { kTRIANGLE,
+                                   kSPHERE,
+                                   kQUAD,
+                                   kOBJECT };
+
+    PrimitiveBvh() {}
+
+    PrimitiveBvh(const ObjectListType &objects, Arena *arena = nullptr, TriangleIntersector intersector = kWATERTIGHT);
+
+    Intersection CheckIntersect(const Ray &r, double t_min, double t_max) const;
+
+    // every primitive the tree holds; these are what intersections point to
+    void GetPrimitives(std::vector<const Object *> &primitives) const;
+
+private:
+    static const int kMaxDepth = 64;
+    static const int kMaxLeafSize = 4;
+    static const int kMaxPacketsPerLeaf = 2;
+
+    // node of the tree as built, before it is quantized
+    struct Node {
+        BoundingBox box_;
+        // second child of an interior node, or the first primitive of a leaf:
+        // in the build list until FillLeaf puts the leaf into the array of its
+        // type, then in that array, which is the packet array for packed types
+        int index_;
+        // primitives in a leaf
+        int size_;
+        // primitives, or packets, in a leaf, 0 for an interior node
+        uint16_t count_;
+        uint8_t type_;
+        uint8_t axis_;
+    };
+
+    // Interior node with the boxes of both children relative to its own. Its
+    // box is split into 255 steps of a power of two per axis from origin_,
+    // and the children's boxes are rounded outwards to whole steps, so they
+    // only ever grow. A leaf child is described here in full and has no node.
+    struct QuantizedNode {
+        float origin_[3];
+        // steps are 2^exponent_
+        int8_t exponent_[3];
+        uint8_t axis_;
+        uint8_t child_min_[2][3];
+        uint8_t child_max_[2][3];
+        // node index of an interior child, or the first primitive (packet) of a leaf
+        int child_index_[2];
+        // primitives (packets) of a leaf child, 0 for an interior child
+        uint16_t child_count_[2];
+        uint8_t child_type_[2];
+
+        double Step(int axis) const {
+            // 2^exponent built from its bits, which is cheaper than ldexp
+            uint32_t bits = static_cast<uint32_t>(exponent_[axis] + 127) << 23;
+            float step;
+            std::memcpy(&step, &bits, sizeof(step));
+            return step;
+        }
+
+        // the same arithmetic while building and tracing, so the bounds the
+        // builder checked are the bounds the ray sees
+        double Dequantize(int axis, uint8_t q) const {
+            return static_cast<double>(origin_[axis]) + q * Step(axis);
+        }
+
+        bool CheckChild(int child, const Ray &r, const Vector3d &inv_direction, double t_min, double t_max) const {
+            for (int i = 0; i < 3; ++i) {
+                double step = Step(i);
+                double t0 = (origin_[i] + child_min_[child][i] * step - r.origin()(i)) * inv_direction(i);
+                double t1 = (origin_[i] + child_max_[child][i] * step - r.origin()(i)) * inv_direction(i);
+                if (t0 > t1) {
+                    std::swap(t0, t1);
+                }
+                t_min = fmax(t0, t_min);
+                t_max = fmin(t1, t_max);
+                if (t_max < t_min) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    struct BuildPrimitive {
+        const Object *object_;
+        BoundingBox box_;
+        PrimitiveType type_;
+    };
+
+    int Build(std::vector<BuildPrimitive> &primitives, size_t begin, size_t end, int depth, std::vector<Node> &nodes);
+
+    // appends the primitives of a leaf to the arrays of its type
+    void FillLeaf(const std::vector<BuildPrimitive> &primitives, Node &node);
+
+    // emits the quantized node for the interior node index of nodes, and
+    // those below it; returns where it went
+    int Quantize(const std::vector<Node> &nodes, int index);
+
+    // whether primitives of a type go into packets rather than one test each
+    bool Packed(PrimitiveType type) const {
+        return type == kSPHERE || (type == kTRIANGLE && intersector_ == kSIMD);
+    }
+
+    // keeps the objects behind objects_ alive
+    ObjectListType owners_;
+    std::vector<QuantizedNode, ArenaAllocator<QuantizedNode>> nodes_;
+    std::vector<const Triangle *, ArenaAllocator<const Triangle *>> triangles_;
+    // one record per triangle for the intersector that needs it
+    TriangleIntersector intersector_ = kWATERTIGHT;
+    std::vector<AffineTriangleRecord, ArenaAllocator<AffineTriangleRecord>> affine_records_;
+    std::vector<WatertightTriangleRecord, ArenaAllocator<WatertightTriangleRecord>> watertight_records_;
+    std::vector<TrianglePacket, ArenaAllocator<TrianglePacket>> packets_;
+    std::vector<const Quad *, ArenaAllocator<const Quad *>> quads_;
+    std::vector<const Sphere *, ArenaAllocator<const Sphere *>> spheres_;
+    std::vector<SpherePacket, ArenaAllocator<SpherePacket>> sphere_packets_;
+    std::vector<const Object *, ArenaAllocator<const Object *>> objects_;
+};
+
+PrimitiveBvh::PrimitiveBvh(const ObjectListType &objects, Arena *arena, TriangleIntersector intersector)
+    : owners_(objects), nodes_(ArenaAllocator<QuantizedNode>(arena)), triangles_(ArenaAllocator<const Triangle *>(arena)), intersector_(intersector),
+      affine_records_(ArenaAllocator<AffineTriangleRecord>(arena)), watertight_records_(ArenaAllocator<WatertightTriangleRecord>(arena)),
+      packets_(ArenaAllocator<TrianglePacket>(arena)), quads_(ArenaAllocator<const Quad *>(arena)),
+      spheres_(ArenaAllocator<const Sphere *>(arena)),
+      sphere_packets_(ArenaAllocator<SpherePacket>(arena)),
+      objects_(ArenaAllocator<const Object *>(arena)) {
+    std::vector<const Object *> flattened;
+    for (const auto &object : objects) {
+        object->GetPrimitives(flattened);
+    }
+    std::vector<BuildPrimitive> primitives;
+    size_t num_triangles = 0, num_quads = 0, num_spheres = 0;
+    for (const Object *object : flattened) {
+        // exact types, as the direct calls would skip a subclass's overrides
+        const std::type_info &object_type = typeid(*object);
+        PrimitiveType type = kOBJECT;
+        if (object_type == typeid(Triangle)) {
+            type = kTRIANGLE;
+        } else if (object_type == typeid(Quad)) {
+            type = kQUAD;
+        } else if (object_type == typeid(Sphere)) {
+            type = kSPHERE;
+        }
+        num_triangles += type == kTRIANGLE;
+        num_quads += type == kQUAD;
+        num_spheres += type == kSPHERE;
+        primitives.push_back({object, object->GetBoundingBox(), type});
+    }
+    if (primitives.empty()) {
+        return;
+    }
+    std::vector<Node> nodes;
+    nodes.reserve(2 * primitives.size() - 1);
+    Build(primitives, 0, primitives.size(), 0, nodes);
+
+    // the leaves are known now, so every array gets exactly the room it needs
+    size_t num_packets = 0, num_sphere_packets = 0;
+    for (const Node &node : nodes) {
+        num_packets += node.type_ == kTRIANGLE && Packed(kTRIANGLE) ? node.count_ : 0;
+        num_sphere_packets += node.type_ == kSPHERE ? node.count_ : 0;
+    }
+    triangles_.reserve(num_triangles);
+    if (intersector_ == kAFFINE) {
+        affine_records_.reserve(num_triangles);
+    } else if (intersector_ == kWATERTIGHT) {
+        watertight_records_.reserve(num_triangles);
+    } else if (intersector_ == kSIMD) {
+        packets_.reserve(num_packets);
+    }
+    quads_.reserve(num_quads);
+    spheres_.reserve(num_spheres);
+    sphere_packets_.reserve(num_sphere_packets);
+    objects_.reserve(primitives.size() - num_triangles - num_quads - num_spheres);
+    for (Node &node : nodes) {
+        if (node.count_ > 0) {
+            FillLeaf(primitives, node);
+        }
+    }
+
+    // there is one interior node fewer than leaves
+    nodes_.reserve(std::max<size_t>(1, nodes.size() / 2));
+    if (nodes[0].count_ > 0) {
+        // a lone leaf hangs twice off an interior root; the second test of
+        // its primitives never finds a nearer hit
+        Node root = nodes[0];
+        root.count_ = 0;
+        root.index_ = 1;
+        nodes.insert(nodes.begin(), root);
+    }
+    Quantize(nodes, 0);
+}
+
+int PrimitiveBvh::Build(std::vector<BuildPrimitive> &primitives, size_t begin_index, size_t end_index, int depth, std::vector<Node> &nodes) {
+    int node_index = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    size_t num_objects = end_index - begin_index;
+
+    BoundingBox box = primitives[begin_index].box_;
+    BoundingBox centroid_box(primitives[begin_index].box_.Centroid());
+    bool same_type = true;
+    for (size_t i = begin_index + 1; i < end_index; ++i) {
+        box = MergeBoxes(box, primitives[i].box_);
+        centroid_box = MergeBoxes(centroid_box, BoundingBox(primitives[i].box_.Centroid()));
+        same_type = same_type && primitives[i].type_ == primitives[begin_index].type_;
+    }
+    size_t axis = MaxDim(centroid_box);
+    double extent = centroid_box.max()(axis) - centroid_box.min()(axis);
+
+    // Split where the surface area heuristic is cheapest among bin boundaries
+    // along the widest centroid axis, or make a leaf if that is cheaper still.
+    // Mixed ranges are always split, since a leaf holds one type.
+    // Deep down, median splits take over to bound the depth by the stack size.
+    size_t mid = begin_index + num_objects / 2;
+    bool packed = same_type && Packed(primitives[begin_index].type_);
+    size_t max_leaf_size = packed ? kMaxPacketsPerLeaf * kPacketWidth : kMaxLeafSize;
+    // primitive tests a leaf of n costs, a packet counting as one
+    auto leaf_cost = [packed](int n) { return packed ? (n + kPacketWidth - 1) / kPacketWidth : n; };
+    bool make_leaf = num_objects == 1 || (num_objects <= max_leaf_size && same_type && extent <= 0.0);
+    bool split_found = false;
+    if (!make_leaf && extent > 0.0 && depth < kMaxDepth / 2) {
+        const int num_bins = 12;
+        int counts[num_bins] = {};
+        BoundingBox bin_boxes[num_bins];
+        auto bin_of = [&](const BuildPrimitive &p) {
+            return std::min(static_cast<int>(num_bins * (p.box_.Centroid()(axis) - centroid_box.min()(axis)) / extent), num_bins - 1);
+        };
+        for (size_t i = begin_index; i < end_index; ++i) {
+            int b = bin_of(primitives[i]);
+            bin_boxes[b] = counts[b]++ ? MergeBoxes(bin_boxes[b], primitives[i].box_) : primitives[i].box_;
+        }
+        // areas and counts of everything right of each boundary, swept from the right
+        double right_areas[num_bins];
+        int right_counts[num_bins];
+        BoundingBox right_box;
+        int right_count = 0;
+        for (int b = num_bins - 1; b > 0; --b) {
+            if (counts[b]) {
+                right_box = right_count ? MergeBoxes(right_box, bin_boxes[b]) : bin_boxes[b];
+                right_count += counts[b];
+            }
+            right_areas[b] = right_count ? right_box.SurfaceArea() : 0.0;
+            right_counts[b] = right_count;
+        }
+        BoundingBox left_box;
+        int left_count = 0, best_bin = -1;
+        double best_cost = infinity;
+        for (int b = 0; b < num_bins - 1; ++b) {
+            if (counts[b]) {
+                left_box = left_count ? MergeBoxes(left_box, bin_boxes[b]) : bin_boxes[b];
+                left_count += counts[b];
+            }
+            if (left_count == 0 || right_counts[b + 1] == 0) {
+                continue;
+            }
+            // traversal step costs an eighth of a primitive test
+            double cost = 0.125 + (leaf_cost(left_count) * left_box.SurfaceArea() + leaf_cost(right_counts[b + 1]) * right_areas[b + 1]) / box.SurfaceArea();
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_bin = b;
+            }
+        }
+        if (num_objects <= max_leaf_size && same_type && leaf_cost(static_cast<int>(num_objects)) <= best_cost) {
+            make_leaf = true;
+        } else if (best_bin >= 0) {
+            split_found = true;
+            mid = std::partition(primitives.begin() + begin_index, primitives.begin() + end_index,
+                                 [&](const BuildPrimitive &p) { return bin_of(p) <= best_bin; }) -
+                  primitives.begin();
+        }
+    }
+
+    if (make_leaf) {
+        Node &node = nodes[node_index];
+        node.box_ = box;
+        node.index_ = static_cast<int>(begin_index);
+        node.size_ = static_cast<int>(num_objects);
+        node.count_ = static_cast<uint16_t>(packed ? leaf_cost(static_cast<int>(num_objects)) : num_objects);
+        node.type_ = primitives[begin_index].type_;
+        node.axis_ = 0;
+        return node_index;
+    }
+
+    if (!split_found) {
+        // no usable bin boundary, e.g. all centroids in one spot: median split
+        std::nth_element(primitives.begin() + begin_index, primitives.begin() + mid, primitives.begin() + end_index,
+                         [axis](const BuildPrimitive &a, const BuildPrimitive &b) { return a.box_.Centroid()(axis) < b.box_.Centroid()(axis); });
+    }
+    Build(primitives, begin_index, mid, depth + 1, nodes);
+    int second = Build(primitives, mid, end_index, depth + 1, nodes);
+
+    nodes[node_index].box_ = box;
+    nodes[node_index].index_ = second;
+    nodes[node_index].count_ = 0;
+    nodes[node_index].axis_ = static_cast<uint8_t>(axis);
+    return node_index;
+}
+
+void PrimitiveBvh::FillLeaf(const std::vector<BuildPrimitive> &primitives, Node &node) {
+    size_t begin_index = node.index_, end_index = begin_index + node.size_;
+    bool packed = Packed(static_cast<PrimitiveType>(node.type_));
+    switch (node.type_) {
+    case kTRIANGLE:
+        node.index_ = static_cast<int>(packed ? packets_.size() : triangles_.size());
+        break;
+    case kQUAD:
+        node.index_ = static_cast<int>(quads_.size());
+        break;
+    case kSPHERE:
+        node.index_ = static_cast<int>(sphere_packets_.size());
+        break;
+    default:
+        node.index_ = static_cast<int>(objects_.size());
+    }
+    for (size_t i = begin_index; i < end_index; ++i) {
+        int lane = static_cast<int>((i - begin_index) % kPacketWidth);
+        if (node.type_ == kTRIANGLE) {
+            if (packed && lane == 0) {
+                packets_.emplace_back(static_cast<int>(triangles_.size()));
+            }
+            triangles_.push_back(static_cast<const Triangle *>(primitives[i].object_));
+            if (intersector_ == kAFFINE) {
+                affine_records_.emplace_back(triangles_.back()->GetVertices());
+            } else if (intersector_ == kWATERTIGHT) {
+                watertight_records_.emplace_back(triangles_.back()->GetVertices());
+            } else if (packed) {
+                packets_.back().Set(lane, triangles_.back()->GetVertices());
+            }
+        } else if (node.type_ == kQUAD) {
+            quads_.push_back(static_cast<const Quad *>(primitives[i].object_));
+        } else if (node.type_ == kSPHERE) {
+            if (lane == 0) {
+                sphere_packets_.emplace_back(static_cast<int>(spheres_.size()));
+            }
+            spheres_.push_back(static_cast<const Sphere *>(primitives[i].object_));
+            sphere_packets_.back().Set(lane, spheres_.back()->center_, spheres_.back()->radius_);
+        } else {
+            objects_.push_back(primitives[i].object_);
+        }
+    }
+}
+
+int PrimitiveBvh::Quantize(const std::vector<Node> &nodes, int index) {
+    const Node &node = nodes[index];
+    QuantizedNode quantized;
+    quantized.axis_ = node.axis_;
+    for (int i = 0; i < 3; ++i) {
+        double min = node.box_.min()(i), max = node.box_.max()(i);
+        float origin = static_cast<float>(min);
+        if (origin > min) {
+            origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+        }
+        quantized.origin_[i] = origin;
+        // the smallest step that spans the box in 255 of them
+        int exponent = max > origin ? std::ilogb((max - origin) / 255) : -126;
+        quantized.exponent_[i] = static_cast<int8_t>(std::max(exponent, -126));
+        while (quantized.Dequantize(i, 255) < max) {
+            ++quantized.exponent_[i];
+        }
+    }
+    int children[2] = {index + 1, node.index_};
+    for (int c = 0; c < 2; ++c) {
+        const Node &child = nodes[children[c]];
+        for (int i = 0; i < 3; ++i) {
+            double step = quantized.Step(i);
+            double min = child.box_.min()(i), max = child.box_.max()(i);
+            int q_min = std::min(255, std::max(0, static_cast<int>(std::floor((min - quantized.origin_[i]) / step))));
+            while (q_min > 0 && quantized.Dequantize(i, q_min) > min) {
+                --q_min;
+            }
+            int q_max = std::min(255, std::max(0, static_cast<int>(std::ceil((max - quantized.origin_[i]) / step))));
+            while (q_max < 255 && quantized.Dequantize(i, q_max) < max) {
+                ++q_max;
+            }
+            quantized.child_min_[c][i] = static_cast<uint8_t>(q_min);
+            quantized.child_max_[c][i] = static_cast<uint8_t>(q_max);
+        }
+        quantized.child_count_[c] = child.count_;
+        quantized.child_type_[c] = child.type_;
+        quantized.child_index_[c] = child.index_;
+    }
+    int quantized_index = static_cast<int>(nodes_.size());
+    nodes_.push_back(quantized);
+    for (int c = 0; c < 2; ++c) {
+        if (nodes[children[c]].count_ == 0) {
+            int child_index = Quantize(nodes, children[c]);
+            nodes_[quantized_index].child_index_[c] = child_index;
+        }
+    }
+    return quantized_index;
+}
+
+Intersection PrimitiveBvh::CheckIntersect(const Ray &r, double t_min, double t_max) const {
+    Intersection ret_intersection;
+    if (nodes_.empty()) {
+        return ret_intersection;
+    }
+    Vector3d inv_direction = Inverse(r.direction());
+    WatertightRay watertight_ray;
+    if (intersector_ == kWATERTIGHT) {
+        watertight_ray = WatertightRay(r);
+    }
+    PacketRay packet_ray(r);
+    // closest hit so far if it came from a triangle record or packet, or a
+    // sphere packet; its intersection is filled in once at the end
+    int hit_triangle = -1, hit_sphere = -1;
+    auto intersect_leaf = [&](int index, int count, uint8_t type) {
+        int end = index + count;
+        double t;
+        if (type == kOBJECT) {
+            for (int i = index; i < end; ++i) {
+                Intersection cur_intersection = objects_[i]->Intersect(r, t_min, t_max);
+                if (cur_intersection.happened_) {
+                    t_max = cur_intersection.t_;
+                    ret_intersection = cur_intersection;
+                    hit_triangle = hit_sphere = -1;
+                }
+            }
+        } else if (type == kQUAD) {
+            for (int i = index; i < end; ++i) {
+                // qualified, so the call is direct
+                Intersection cur_intersection = quads_[i]->Quad::Intersect(r, t_min, t_max);
+                if (cur_intersection.happened_) {
+                    t_max = cur_intersection.t_;
+                    ret_intersection = cur_intersection;
+                    hit_triangle = hit_sphere = -1;
+                }
+            }
+        } else if (type == kSPHERE) {
+            for (int i = index; i < end; ++i) {
+                float packet_t;
+                int lane = sphere_packets_[i].Intersect(packet_ray, static_cast<float>(t_min), static_cast<float>(t_max), packet_t);
+                if (lane >= 0) {
+                    t_max = packet_t;
+                    hit_sphere = sphere_packets_[i].first_ + lane;
+                    hit_triangle = -1;
+                }
+            }
+        } else if (intersector_ == kWATERTIGHT) {
+            for (int i = index; i < end; ++i) {
+                if (watertight_records_[i].Intersect(watertight_ray, t_min, t_max, t)) {
+                    t_max = t;
+                    hit_triangle = i;
+                    hit_sphere = -1;
+                }
+            }
+        } else if (intersector_ == kSIMD) {
+            for (int i = index; i < end; ++i) {
+                float packet_t;
+                int lane = packets_[i].Intersect(packet_ray, static_cast<float>(t_min), static_cast<float>(t_max), packet_t);
+                if (lane >= 0) {
+                    t_max = packet_t;
+                    hit_triangle = packets_[i].first_ + lane;
+                    hit_sphere = -1;
+                }
+            }
+        } else if (intersector_ == kAFFINE) {
+            for (int i = index; i < end; ++i) {
+                if (affine_records_[i].Intersect(r, t_min, t_max, t)) {
+                    t_max = t;
+                    hit_triangle = i;
+                    hit_sphere = -1;
+                }
+            }
+        } else {
+            for (int i = index; i < end; ++i) {
+                // qualified, so the call is direct
+                Intersection cur_intersection = triangles_[i]->Triangle::Intersect(r, t_min, t_max);
+                if (cur_intersection.happened_) {
+                    t_max = cur_intersection.t_;
+                    ret_intersection = cur_intersection;
+                    hit_sphere = -1;
+                }
+            }
+        }
+    };
+
+    int node_stack[kMaxDepth];
+    int stack_size = 0;
+    int node_index = 0;
+
+    while (true) {
+        const QuantizedNode &node = nodes_[node_index];
+        // the child on the near side of the split first, and a leaf child's
+        // hit before the other child's box is tested
+        int near = r.direction()(node.axis_) < 0 ? 1 : 0;
+        int next[2];
+        int num_next = 0;
+        for (int k = 0; k < 2; ++k) {
+            int c = near ^ k;
+            if (!node.CheckChild(c, r, inv_direction, t_min, t_max)) {
+                continue;
+            }
+            if (node.child_count_[c] > 0) {
+                intersect_leaf(node.child_index_[c], node.child_count_[c], node.child_type_[c]);
+            } else {
+                next[num_next++] = node.child_index_[c];
+            }
+        }
+        if (num_next > 0) {
+            if (num_next == 2) {
+                node_stack[stack_size++] = next[1];
+            }
+            node_index = next[0];
+            continue;
+        }
+        if (stack_size == 0) {
+            break;
+        }
+        node_index = node_stack[--stack_size];
+    }
+    if (hit_triangle >= 0) {
+        if (intersector_ == kSIMD) {
+            // the packet test's t is single precision; put the hit back on the
+            // plane in double, as a shading point to trace the next ray from
+            t_max = triangles_[hit_triangle]->PlaneDistance(r);
+        }
+        return triangles_[hit_triangle]->HitAt(r, t_max);
+    }
+    if (hit_sphere >= 0) {
+        // likewise redo the single precision sphere test in double, keeping
+        // its t should a grazing hit not survive
+        Intersection sphere_intersection = spheres_[hit_sphere]->Sphere::Intersect(r, t_min, infinity);
+        return sphere_intersection.happened_ ? sphere_intersection : spheres_[hit_sphere]->HitAt(r, t_max);
+    }
+    return ret_intersection;
+}
+
+void PrimitiveBvh::GetPrimitives(std::vector<const Object *> &primitives) const {
+    primitives.insert(primitives.end(), triangles_.begin(), triangles_.end());
+    primitives.insert(primitives.end(), quads_.begin(), quads_.end());
+    primitives.insert(primitives.end(), spheres_.begin(), spheres_.end());
+    primitives.insert(primitives.end(), objects_.begin(), objects_.end());
+}
+
+} // namespace Bvh
+#endif
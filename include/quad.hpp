@@ -0,0 +1,321 @@
+#ifndef TR_INCLUDE_QUAD_H
+#define TR_INCLUDE_QUAD_H
+
+#include <array>
+
+#include "base.hpp"
+#include "bounding_box.hpp"
+#include "material.hpp"
+#include "object.hpp"
+
+// Quadrilateral with its corners in order around the edge, intersected as the
+// bilinear patch through them (Reshetov, "Cool Patches: A Geometric Approach
+// to Ray/Bilinear Patch Intersections", 2019). For a planar convex quad the
+// patch is the quad itself, so one primitive stands in for the two triangles
+// it would be split into, and is tested as its plane clipped by the four edges.
+// The patch is P(u, v) = (1-u)(1-v) v0 + u(1-v) v1 + uv v2 + (1-u)v v3, and
+// its front faces the way the corners wind, like a triangle's. A planar quad
+// must be convex. Loading only merges triangle pairs that pass IsPlanarConvex;
+// curved patches come from scenes built in code.
+class Quad : public Object {
+public:
+    Quad() {}
+    Quad(Vector3d v0, Vector3d v1, Vector3d v2, Vector3d v3, MaterialId m);
+
+    virtual Intersection Intersect(const Ray &r, double t_min, double t_max) const override;
+    virtual BoundingBox GetBoundingBox() const override;
+    virtual void Sample(Intersection &inter, double &pdf, Sampler &sampler) const override;
+    virtual void Sample(const Point3d &ref, Intersection &inter, double &pdf, Sampler &sampler) const override;
+    virtual double Pdf(const Point3d &ref, const Point3d &p) const override;
+
+    virtual double GetArea() const override { return surface_area_; }
+    virtual MaterialId GetMaterial() const override { return material_; }
+
+    virtual void GetNormalCone(Vector3d &axis, double &cos_theta) const override {
+        axis = cone_axis_;
+        cos_theta = cone_cos_theta_;
+    }
+
+    const std::array<Point3d, 4> &GetVertices() const { return vertex_coords_; }
+
+    bool IsPlanar() const { return planar_; }
+
+    static bool IsPlanarConvex(const std::array<Point3d, 4> &v);
+
+private:
+    // as for Triangle
+    static constexpr double kMinSolidAngle = 3e-4;
+    static constexpr double kMaxSolidAngle = 6.22;
+
+    // nearest front face hit on a planar quad in (t_min, t_max)
+    bool IntersectPlanar(const Ray &r, double t_min, double t_max, double &t) const;
+
+    // nearest front face hit in (t_min, t_max) and its patch coordinates
+    bool IntersectPatch(const Ray &r, double t_min, double t_max, double &t, double &u, double &v) const;
+
+    Point3d PatchPoint(double u, double v) const {
+        return (1 - u) * (1 - v) * vertex_coords_[0] + u * (1 - v) * vertex_coords_[1] + u * v * vertex_coords_[2] + (1 - u) * v * vertex_coords_[3];
+    }
+
+    // dP/du x dP/dv, the normal scaled by the area the patch covers per unit uv
+    Vector3d PatchNormal(double u, double v) const {
+        Vector3d dpdu = (1 - v) * (vertex_coords_[1] - vertex_coords_[0]) + v * (vertex_coords_[2] - vertex_coords_[3]);
+        Vector3d dpdv = (1 - u) * (vertex_coords_[3] - vertex_coords_[0]) + u * (vertex_coords_[2] - vertex_coords_[1]);
+        return CrossProduct(dpdu, dpdv);
+    }
+
+    // Solid angles of the triangles v0 v1 v2 and v0 v2 v3 of a planar quad seen
+    // from ref. Their sum is 0 where ref falls back to area sampling.
+    double SamplingSolidAngle(const Point3d &ref, double &solid_angle_0) const;
+
+    std::array<Point3d, 4> vertex_coords_;
+    MaterialId material_;
+    // of the plane; for a curved patch only used through the normal cone
+    Vector3d normal_;
+    // for a planar quad, the plane's offset along the normal, and in-plane
+    // normals of the edges pointing inwards with their offsets
+    double plane_offset_;
+    Vector3d edge_normals_[4];
+    double edge_offsets_[4];
+    Vector3d cone_axis_;
+    double cone_cos_theta_;
+    double surface_area_;
+    bool planar_;
+};
+
+Quad::Quad(Vector3d v0, Vector3d v1, Vector3d v2, Vector3d v3, MaterialId m)
+    : vertex_coords_({v0, v1, v2, v3}), material_(m) {
+    // the cross product of the diagonals is twice the area vector of a planar quad
+    Vector3d area_vector = 0.5 * CrossProduct(v2 - v0, v3 - v1);
+    normal_ = Normalize(area_vector);
+    double size = fmax(Length(v2 - v0), Length(v3 - v1));
+    planar_ = fabs(DotProduct(normal_, v1 - v0)) <= 1e-9 * size && fabs(DotProduct(normal_, v3 - v0)) <= 1e-9 * size;
+    if (planar_) {
+        plane_offset_ = DotProduct(normal_, v0);
+        for (int i = 0; i < 4; ++i) {
+            edge_normals_[i] = CrossProduct(normal_, vertex_coords_[(i + 1) % 4] - vertex_coords_[i]);
+            edge_offsets_[i] = DotProduct(edge_normals_[i], vertex_coords_[i]);
+        }
+        surface_area_ = Length(area_vector);
+        cone_axis_ = normal_;
+        cone_cos_theta_ = 1.0;
+        return;
+    }
+    // the area by the midpoint rule
+    const int n = 16;
+    surface_area_ = 0.0;
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            surface_area_ += Length(PatchNormal((i + 0.5) / n, (j + 0.5) / n)) / (n * n);
+        }
+    }
+    // The unnormalized normal is bilinear in u and v, so every normal lies in
+    // the cone spanned by the corner normals.
+    Vector3d corner_normals[4] = {Normalize(PatchNormal(0, 0)), Normalize(PatchNormal(1, 0)),
+                                  Normalize(PatchNormal(1, 1)), Normalize(PatchNormal(0, 1))};
+    cone_axis_ = Normalize(corner_normals[0] + corner_normals[1] + corner_normals[2] + corner_normals[3]);
+    cone_cos_theta_ = 1.0;
+    for (const Vector3d &corner_normal : corner_normals) {
+        cone_cos_theta_ = fmin(cone_cos_theta_, DotProduct(cone_axis_, corner_normal));
+    }
+    if (cone_cos_theta_ <= 0.0) {
+        cone_axis_ = Vector3d(0, 0, 1);
+        cone_cos_theta_ = -1.0;
+    }
+}
+
+bool Quad::IsPlanarConvex(const std::array<Point3d, 4> &v) {
+    Quad quad(v[0], v[1], v[2], v[3], 0);
+    if (!quad.IsPlanar()) {
+        return false;
+    }
+    // every corner turns the same way
+    for (int i = 0; i < 4; ++i) {
+        if (DotProduct(CrossProduct(v[(i + 1) % 4] - v[i], v[(i + 2) % 4] - v[(i + 1) % 4]), quad.normal_) <= 0.0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Intersection Quad::Intersect(const Ray &r, double t_min, double t_max) const {
+    Intersection ret_intersection;
+    double t, u = 0, v = 0;
+    if (planar_ ? !IntersectPlanar(r, t_min, t_max, t) : !IntersectPatch(r, t_min, t_max, t, u, v)) {
+        return ret_intersection;
+    }
+    ret_intersection.happened_ = true;
+    ret_intersection.p_ = r.at(t);
+    ret_intersection.t_ = t;
+    ret_intersection.normal_ = planar_ ? normal_ : Normalize(PatchNormal(u, v));
+    ret_intersection.material_id_ = material_;
+    ret_intersection.object_ = this;
+    return ret_intersection;
+}
+
+bool Quad::IntersectPlanar(const Ray &r, double t_min, double t_max, double &t) const {
+    double cos_theta = DotProduct(normal_, r.direction());
+    // front faces only, like Triangle::Intersect
+    if (cos_theta >= 0.0) {
+        return false;
+    }
+    t = (plane_offset_ - DotProduct(normal_, r.origin())) / cos_theta;
+    if (t <= t_min || t >= t_max) {
+        return false;
+    }
+    Point3d p = r.at(t);
+    for (int i = 0; i < 4; ++i) {
+        if (DotProduct(edge_normals_[i], p) < edge_offsets_[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Each u gives a line across the patch from the edge v0 v1 to the edge v3 v2.
+// The ray meets that line where a quadratic in u vanishes, and the distance
+// along the line gives v.
+bool Quad::IntersectPatch(const Ray &r, double t_min, double t_max, double &t, double &u, double &v) const {
+    const Vector3d &d = r.direction();
+    Vector3d q00 = vertex_coords_[0] - r.origin(), q10 = vertex_coords_[1] - r.origin();
+    Vector3d q11 = vertex_coords_[2] - r.origin(), q01 = vertex_coords_[3] - r.origin();
+    Vector3d e10 = q10 - q00, e11 = q11 - q10, e00 = q01 - q00;
+    // a + b u + c u^2 = 0, with b found from a + b + c
+    double a = DotProduct(CrossProduct(q00, d), e00);
+    double c = DotProduct(CrossProduct(e10, q01 - q11), d);
+    double b = DotProduct(CrossProduct(q10, d), e11) - a - c;
+    double discriminant = b * b - 4 * a * c;
+    if (discriminant < 0) {
+        return false;
+    }
+    double roots[2];
+    if (c == 0) {
+        // a parallelogram, or a ray parallel to the patch's twist
+        roots[0] = -a / b;
+        roots[1] = -1;
+    } else {
+        // the stable pair of quadratic roots
+        double q = -0.5 * (b + copysign(sqrt(discriminant), b));
+        roots[0] = q / c;
+        roots[1] = a / q;
+    }
+    bool found = false;
+    for (double root : roots) {
+        if (!(root >= 0 && root <= 1)) {
+            continue;
+        }
+        Vector3d pa = q00 + root * e10;
+        Vector3d pb = e00 + root * (e11 - e00);
+        Vector3d n = CrossProduct(d, pb);
+        double det = DotProduct(n, n);
+        if (det == 0) {
+            continue;
+        }
+        n = CrossProduct(n, pa);
+        double t_root = DotProduct(n, pb) / det;
+        double v_root = DotProduct(n, d) / det;
+        if (v_root < 0 || v_root > 1 || t_root <= t_min || t_root >= t_max) {
+            continue;
+        }
+        // front faces only, like Triangle::Intersect
+        if (DotProduct(d, PatchNormal(root, v_root)) > 0) {
+            continue;
+        }
+        t_max = t = t_root;
+        u = root;
+        v = v_root;
+        found = true;
+    }
+    return found;
+}
+
+BoundingBox Quad::GetBoundingBox() const {
+    return MergeBoxes(BoundingBox(vertex_coords_[0], vertex_coords_[1]), BoundingBox(vertex_coords_[2], vertex_coords_[3]));
+}
+
+// Uniform over a planar quad, by picking one of its two triangles by area. A
+// curved patch is sampled uniformly in uv, which has area density 1 / |dP/du x
+// dP/dv| there.
+void Quad::Sample(Intersection &inter, double &pdf, Sampler &sampler) const {
+    Vector2d u = sampler.Get2D();
+    if (!planar_) {
+        Vector3d n = PatchNormal(u.x(), u.y());
+        inter.p_ = PatchPoint(u.x(), u.y());
+        inter.normal_ = Normalize(n);
+        pdf = 1.0 / Length(n);
+        return;
+    }
+    double area_0 = 0.5 * Length(CrossProduct(vertex_coords_[1] - vertex_coords_[0], vertex_coords_[2] - vertex_coords_[0]));
+    double pick = area_0 / surface_area_;
+    const Point3d &a = vertex_coords_[0];
+    const Point3d &b = u.x() < pick ? vertex_coords_[1] : vertex_coords_[2];
+    const Point3d &c = u.x() < pick ? vertex_coords_[2] : vertex_coords_[3];
+    // reuse the part of u.x past the pick
+    double x = std::sqrt(u.x() < pick ? u.x() / pick : (u.x() - pick) / (1.0 - pick)), y = u.y();
+    inter.p_ = a * (1.0 - x) + b * (x * (1.0 - y)) + c * (x * y);
+    inter.normal_ = normal_;
+    pdf = 1.0 / surface_area_;
+}
+
+// A planar quad is sampled uniformly in the solid angle it subtends from ref,
+// as two spherical triangles picked by their solid angles.
+void Quad::Sample(const Point3d &ref, Intersection &inter, double &pdf, Sampler &sampler) const {
+    double solid_angle_0;
+    double solid_angle = SamplingSolidAngle(ref, solid_angle_0);
+    if (solid_angle == 0.0) {
+        Sample(inter, pdf, sampler);
+        return;
+    }
+    Vector2d u = sampler.Get2D();
+    double pick = solid_angle_0 / solid_angle;
+    int second = u.x() < pick ? 1 : 2;
+    Vector2d remapped(u.x() < pick ? u.x() / pick : (u.x() - pick) / (1.0 - pick), u.y());
+    Vector3d w = SampleSphericalTriangle(Normalize(vertex_coords_[0] - ref), Normalize(vertex_coords_[second] - ref),
+                                         Normalize(vertex_coords_[second + 1] - ref), remapped);
+    // ref is in front, so w runs against the normal into the quad's plane
+    double cos_light = -DotProduct(w, normal_);
+    if (cos_light <= 0.0) {
+        pdf = 0.0;
+        return;
+    }
+    double t = DotProduct(ref - vertex_coords_[0], normal_) / cos_light;
+    inter.p_ = ref + t * w;
+    inter.normal_ = normal_;
+    // 1 / solid_angle per steradian, converted to per unit area
+    pdf = cos_light / (t * t * solid_angle);
+}
+
+double Quad::Pdf(const Point3d &ref, const Point3d &p) const {
+    if (!planar_) {
+        // the patch coordinates of p, from the ray that found it
+        double t, u, v;
+        if (!IntersectPatch(Ray(ref, p - ref), 0.0, infinity, t, u, v)) {
+            return 1.0 / surface_area_;
+        }
+        return 1.0 / Length(PatchNormal(u, v));
+    }
+    double solid_angle_0;
+    double solid_angle = SamplingSolidAngle(ref, solid_angle_0);
+    if (solid_angle == 0.0) {
+        return 1.0 / surface_area_;
+    }
+    double distance_sqr = LengthSquared(p - ref);
+    double cos_light = fabs(DotProduct(p - ref, normal_)) / sqrt(distance_sqr);
+    return cos_light / (distance_sqr * solid_angle);
+}
+
+double Quad::SamplingSolidAngle(const Point3d &ref, double &solid_angle_0) const {
+    // behind the quad nothing is lit, so any pdf will do
+    if (!planar_ || DotProduct(ref - vertex_coords_[0], normal_) <= 0.0) {
+        return 0.0;
+    }
+    Vector3d w[4];
+    for (int i = 0; i < 4; ++i) {
+        w[i] = Normalize(vertex_coords_[i] - ref);
+    }
+    solid_angle_0 = SphericalTriangleArea(w[0], w[1], w[2]);
+    double solid_angle = solid_angle_0 + SphericalTriangleArea(w[0], w[2], w[3]);
+    return solid_angle < kMinSolidAngle || solid_angle > kMaxSolidAngle ? 0.0 : solid_angle;
+}
+
+#endif
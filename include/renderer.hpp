@@ -1,23 +1,96 @@
 #ifndef TR_INCLUDE_RENDERER_H
 #define TR_INCLUDE_RENDERER_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
+#include "accumulation_buffer.hpp"
 #include "base.hpp"
 #include "camera.hpp"
+#include "checkpoint.hpp"
+#include "image_writer.hpp"
 #include "material.hpp"
+#include "parallel.hpp"
+#include "sampler.hpp"
 #include "scene.hpp"
 
 std::mutex mutex_ins;
 
 const double russian_roulette = 0.8;
 
+// edge length in pixels of the square tiles handed to worker threads
+const int tile_size = 16;
+
+struct ProgressiveSettings {
+    int samples_per_pass = 4;
+    // a preview is written when either interval has elapsed, 0 disables that trigger
+    int preview_interval_passes = 0;
+    double preview_interval_seconds = 0.0;
+    std::string preview_filename;
+    // render until this many seconds have passed instead of to a fixed sample count
+    double time_budget_seconds = 0.0;
+    // stop sampling tiles whose mean relative pixel error falls below this, 0 disables
+    double adaptive_threshold = 0.0;
+    // samples every pixel receives before its tile may be considered converged
+    int adaptive_min_samples = 8;
+    // a checkpoint is saved when either interval has elapsed, 0 disables that trigger
+    std::string checkpoint_filename;
+    int checkpoint_interval_passes = 0;
+    double checkpoint_interval_seconds = 0.0;
+};
+
+// Multiple importance sampling weights: the balance heuristic, or the power
+// heuristic with exponent 2, which usually has lower variance.
+enum MisHeuristic { kBALANCE,
+                    kPOWER };
+
+// first-hit surface attributes recorded for the denoiser's feature buffers
+struct FirstHit {
+    Color3d albedo_;
+    Vector3d normal_;
+    double depth_ = 0.0;
+};
+
+struct RenderStats {
+    // the most samples any pixel received, and the mean over all pixels
+    int samples_per_pixel_ = 0;
+    double average_samples_per_pixel_ = 0.0;
+    int passes_ = 0;
+    double seconds_ = 0.0;
+};
+
 class Renderer {
 public:
     Renderer() {}
+    // depth caps the surface interactions of a path; 0 leaves the length to
+    // Russian roulette alone
     Renderer(int width, double aspect_ratio, int samples, int depth)
-        : image_width_(width), image_height_(static_cast<int>(width / aspect_ratio)), samples_per_pixel_(samples), max_depth_(depth) {}
+        : image_width_(width), image_height_(static_cast<int>(width / aspect_ratio)), samples_per_pixel_(samples), max_depth_(depth),
+          sampler_type_(Sampler::kSOBOL), mis_heuristic_(kPOWER) {}
+
+    int ImageWidth() const { return image_width_; }
+    int ImageHeight() const { return image_height_; }
+
+    void SetSamplerType(Sampler::SamplerType type) { sampler_type_ = type; }
+
+    // a checkpoint holding the settings of a progressive render that has not started
+    RenderCheckpoint CheckpointSettings(int sample_begin, int sample_count, const ProgressiveSettings &settings) const {
+        RenderCheckpoint checkpoint;
+        checkpoint.sample_begin_ = sample_begin;
+        checkpoint.sample_count_ = sample_count;
+        checkpoint.samples_per_pass_ = settings.samples_per_pass;
+        checkpoint.adaptive_min_samples_ = settings.adaptive_min_samples;
+        checkpoint.sampler_type_ = sampler_type_;
+        checkpoint.adaptive_threshold_ = settings.adaptive_threshold;
+        checkpoint.time_budget_seconds_ = settings.time_budget_seconds;
+        checkpoint.next_sample_ = sample_begin;
+        return checkpoint;
+    }
 
     /*
     void Render(std::ostream &os, const Camera &cam, const Bvh::BvhTree bvh_tree) const {
@@ -40,120 +113,431 @@ public:
     }
 */
 
-    void Render(std::ostream &os, Scene &scene) const {
-        std::vector<Color3d> frame_buffer(image_width_ * image_height_);
+    void Render(std::ostream &os, Scene &scene, ImageFormat format = kP6) const {
+        AccumulationBuffer buffer(image_width_, image_height_);
+        RenderSamples(buffer, scene, 0, samples_per_pixel_);
+        WriteImage(os, buffer, format);
+    }
+
+    // Render samples [sample_begin, sample_begin + sample_count) of every pixel into
+    // the buffer. Every sample seeds its own random stream from its pixel and sample
+    // index, so disjoint ranges rendered by separate runs can be merged afterwards.
+    // When active_tiles is given, tiles flagged 0 are skipped and the range is
+    // recorded as one not every pixel took.
+    void RenderSamples(AccumulationBuffer &buffer, Scene &scene, int sample_begin, int sample_count,
+                       const std::vector<char> *active_tiles = nullptr) const {
+        assert(buffer.Width() == image_width_ && buffer.Height() == image_height_);
 
+        int num_tiles = NumTiles();
         int cnt = 0;
 
-        auto get_color = [&](int row_begin, int row_end, int column_begin, int column_end) {
+        auto render_tile = [&](int tile) {
+            if (active_tiles && !(*active_tiles)[tile]) {
+                return;
+            }
+            int row_begin, row_end, column_begin, column_end;
+            GetTileBounds(tile, row_begin, row_end, column_begin, column_end);
+
             for (int x = row_begin; x < row_end; ++x) {
                 for (int y = column_begin; y < column_end; ++y) {
-                    Color3d pixel_color(0, 0, 0);
-                    for (int s = 0; s < samples_per_pixel_; ++s) {
-                        auto u = (y + TrRandom::Double()) / (image_width_ - 1);
-                        auto v = (x + TrRandom::Double()) / (image_height_ - 1);
-                        Ray r = scene.camera_.GetRay(u, v);
-                        pixel_color += CastRay(r, scene, max_depth_);
-                    }
-                    frame_buffer[x * image_width_ + y] = pixel_color;
+                    int index = x * image_width_ + y;
+                    PixelSamples samples = SamplePixel(scene, x, y, sample_begin, sample_count);
+                    buffer.AddSamples(index, samples.radiance_, sample_count, samples.half_radiance_, samples.half_count_);
+                    buffer.AddFeatures(index, samples.first_hits_.albedo_, samples.first_hits_.normal_, samples.first_hits_.depth_);
                 }
             }
 
             std::lock_guard<std::mutex> g1(mutex_ins);
-            std::cerr << "\rFinish threads num: " << ++cnt << std::flush;
+            std::cerr << "\rFinish tiles num: " << ++cnt << "/" << num_tiles << std::flush;
         };
 
-        int block_width = 25, block_height = 25;
-        int block_size_x = image_height_ / block_height;
-        int block_size_y = image_width_ / block_width;
+        TrParallel::ParallelFor(num_tiles, render_tile);
+        buffer.AddSampleRange(sample_begin, sample_begin + sample_count, active_tiles == nullptr);
+    }
 
-        std::vector<std::thread> threads;
+    // Render samples [sample_begin, sample_begin + samples_per_pixel) straight into
+    // a P6 or PFM file without a framebuffer. Workers take bands of tile_size rows,
+    // and every finished band is written through its own memory map of the file,
+    // so memory use depends on the image width and the thread count but not on the
+    // height. The pixels are identical to those of RenderSamples.
+    bool RenderStreaming(const std::string &filename, Scene &scene, int sample_begin, ImageFormat format) const {
+        MappedImageFile file;
+        if (!file.Open(filename, image_width_, image_height_, format)) {
+            return false;
+        }
 
-        for (int x = 0; x < block_height; ++x) {
-            for (int y = 0; y < block_width; ++y) {
-                int x_begin = x * block_size_x;
-                int y_begin = y * block_size_y;
-                threads.emplace_back(get_color, x_begin, x_begin + block_size_x, y_begin, y_begin + block_size_y);
+        int num_bands = (image_height_ + tile_size - 1) / tile_size;
+        std::atomic<bool> failed(false);
+        int cnt = 0;
+        TrParallel::ParallelFor(num_bands, [&](int band) {
+            int row_begin = band * tile_size;
+            int row_count = std::min(tile_size, image_height_ - row_begin);
+            std::vector<Color3d> radiance(static_cast<size_t>(row_count) * image_width_);
+            for (int x = row_begin; x < row_begin + row_count; ++x) {
+                for (int y = 0; y < image_width_; ++y) {
+                    radiance[(x - row_begin) * image_width_ + y] = SamplePixel(scene, x, y, sample_begin, samples_per_pixel_).radiance_;
+                }
+            }
+            if (!file.WriteRows(row_begin, row_count, radiance, samples_per_pixel_)) {
+                failed = true;
             }
+
+            std::lock_guard<std::mutex> g1(mutex_ins);
+            std::cerr << "\rFinish bands num: " << ++cnt << "/" << num_bands << std::flush;
+        });
+
+        return file.Close() && !failed;
+    }
+
+    // Render the same samples as RenderSamples in passes of settings.samples_per_pass,
+    // accumulating into the buffer. Previews are encoded from a snapshot on a
+    // background thread while the next pass renders; a preview that comes due while
+    // the previous one is still being written is skipped rather than waited for.
+    //
+    // With a time budget, passes continue until the deadline and sample_count only
+    // caps the total (<= 0 for no cap). A pass is never interrupted: the next one is
+    // started only if the last pass's duration still fits in the remaining budget.
+    //
+    // With adaptive sampling, sample_count * pixels is a budget shared by the whole
+    // frame. Tiles whose error estimate drops below the threshold stop sampling and
+    // the samples they leave unused go to the tiles that are still noisy.
+    //
+    // Checkpoints are saved from a snapshot in the background like previews. To
+    // resume, pass the buffer and checkpoint loaded from one along with the
+    // settings it was saved with; the finished frame is then identical to that of
+    // an uninterrupted run (time budgets aside, which depend on the clock anyway).
+    RenderStats RenderProgressive(AccumulationBuffer &buffer, Scene &scene, int sample_begin, int sample_count,
+                                  const ProgressiveSettings &settings, const RenderCheckpoint *resume = nullptr) const {
+        using Clock = std::chrono::steady_clock;
+
+        assert(settings.samples_per_pass > 0);
+        bool time_budgeted = settings.time_budget_seconds > 0.0;
+        bool capped = !time_budgeted || sample_count > 0;
+        bool adaptive = settings.adaptive_threshold > 0.0;
+        bool preview_enabled = !settings.preview_filename.empty() &&
+                               (settings.preview_interval_passes > 0 || settings.preview_interval_seconds > 0.0);
+
+        long long num_pixels = static_cast<long long>(image_width_) * image_height_;
+        long long sample_budget = capped ? sample_count * num_pixels : 0;
+        long long active_pixels = num_pixels;
+        std::vector<char> active_tiles(NumTiles(), 1);
+
+        RenderCheckpoint checkpoint = CheckpointSettings(sample_begin, sample_count, settings);
+        if (resume) {
+            assert(checkpoint.SameSettings(*resume));
+            checkpoint = *resume;
         }
 
-        for (auto &th : threads) {
-            th.join();
+        std::thread preview_thread, checkpoint_thread;
+        std::atomic<bool> preview_busy(false), checkpoint_busy(false);
+        auto start_time = Clock::now() - std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(checkpoint.seconds_));
+        auto last_preview_time = Clock::now();
+        auto last_checkpoint_time = last_preview_time;
+
+        RenderStats stats;
+        stats.passes_ = checkpoint.passes_;
+        int last_preview_pass = stats.passes_;
+        int last_checkpoint_pass = stats.passes_;
+        int pass_begin = checkpoint.next_sample_;
+        long long samples_spent = checkpoint.samples_spent_;
+        // tiles that stopped sampling still have their error below the threshold
+        if (adaptive && pass_begin - sample_begin >= settings.adaptive_min_samples) {
+            active_pixels = UpdateActiveTiles(buffer, active_tiles, settings.adaptive_threshold);
         }
 
-        os << "P3\n"
-           << image_width_ << " " << image_height_ << "\n255\n";
-        for (int j = image_height_ - 1; j >= 0; --j) {
-            for (int i = 0; i < image_width_; ++i) {
-                WriteColor(os, frame_buffer[j * image_width_ + i], samples_per_pixel_);
+        auto due = [&](Clock::time_point now, Clock::time_point last_time, int last_pass, int interval_passes, double interval_seconds) {
+            double seconds = std::chrono::duration<double>(now - last_time).count();
+            return (interval_passes > 0 && stats.passes_ - last_pass >= interval_passes) ||
+                   (interval_seconds > 0.0 && seconds >= interval_seconds);
+        };
+
+        while (active_pixels > 0) {
+            auto pass_start_time = Clock::now();
+            int pass_count = settings.samples_per_pass;
+            if (capped) {
+                pass_count = std::min<long long>(pass_count, (sample_budget - samples_spent) / active_pixels);
+                if (pass_count <= 0) {
+                    break;
+                }
+            }
+            RenderSamples(buffer, scene, pass_begin, pass_count, adaptive ? &active_tiles : nullptr);
+            pass_begin += pass_count;
+            samples_spent += active_pixels * pass_count;
+            ++stats.passes_;
+
+            if (adaptive && pass_begin - sample_begin >= settings.adaptive_min_samples) {
+                active_pixels = UpdateActiveTiles(buffer, active_tiles, settings.adaptive_threshold);
+            }
+
+            auto now = Clock::now();
+            double elapsed = std::chrono::duration<double>(now - start_time).count();
+            double pass_seconds = std::chrono::duration<double>(now - pass_start_time).count();
+            bool last_pass = active_pixels == 0 ||
+                             (capped && sample_budget - samples_spent < active_pixels) ||
+                             (time_budgeted && elapsed + pass_seconds > settings.time_budget_seconds);
+
+            std::cerr << "\rPass " << stats.passes_ << ", " << pass_begin - sample_begin << " spp, "
+                      << active_pixels << " active pixels, " << elapsed << " s " << std::flush;
+
+            if (last_pass) {
+                break;
             }
+            if (!settings.checkpoint_filename.empty() && !checkpoint_busy &&
+                due(now, last_checkpoint_time, last_checkpoint_pass, settings.checkpoint_interval_passes, settings.checkpoint_interval_seconds)) {
+                if (checkpoint_thread.joinable()) {
+                    checkpoint_thread.join();
+                }
+                checkpoint.passes_ = stats.passes_;
+                checkpoint.next_sample_ = pass_begin;
+                checkpoint.samples_spent_ = samples_spent;
+                checkpoint.seconds_ = elapsed;
+                checkpoint_busy = true;
+                checkpoint_thread = std::thread([snapshot = buffer, checkpoint, &settings, &checkpoint_busy]() {
+                    if (!SaveCheckpoint(settings.checkpoint_filename, checkpoint, snapshot)) {
+                        std::cerr << "\nFailed to write checkpoint " << settings.checkpoint_filename << "\n";
+                    }
+                    checkpoint_busy = false;
+                });
+                last_checkpoint_time = now;
+                last_checkpoint_pass = stats.passes_;
+            }
+            if (!preview_enabled || preview_busy) {
+                continue;
+            }
+            if (due(now, last_preview_time, last_preview_pass, settings.preview_interval_passes, settings.preview_interval_seconds)) {
+                if (preview_thread.joinable()) {
+                    preview_thread.join();
+                }
+                preview_busy = true;
+                preview_thread = std::thread([snapshot = buffer, &settings, &preview_busy]() {
+                    if (!WriteImageFile(settings.preview_filename, snapshot, ImageFormatFromFilename(settings.preview_filename))) {
+                        std::cerr << "\nFailed to write preview " << settings.preview_filename << "\n";
+                    }
+                    preview_busy = false;
+                });
+                last_preview_time = now;
+                last_preview_pass = stats.passes_;
+            }
+        }
+
+        if (preview_thread.joinable()) {
+            preview_thread.join();
         }
+        if (checkpoint_thread.joinable()) {
+            checkpoint_thread.join();
+        }
+        stats.samples_per_pixel_ = pass_begin - sample_begin;
+        stats.average_samples_per_pixel_ = static_cast<double>(samples_spent) / num_pixels;
+        stats.seconds_ = std::chrono::duration<double>(Clock::now() - start_time).count();
+        return stats;
     }
 
-    Color3d CastRay(const Ray &r, Scene &scene, int depth) const {
+    // Path tracing with next event estimation. Emitters are reached two ways: by
+    // sampling a point on a light, and by a BSDF-sampled continuation ray that
+    // happens to hit one. Both estimates are kept and weighted by multiple
+    // importance sampling (Veach and Guibas, "Optimally Combining Sampling
+    // Techniques"), so whichever strategy has the higher density for a direction
+    // dominates: light sampling for diffuse surfaces and large lights, BSDF
+    // sampling for glossy reflections of small lights. The environment is a
+    // light of its own, sampled and weighted the same way against rays that
+    // escape the scene.
+    Color3d CastRay(const Ray &r, Scene &scene, Sampler &sampler, FirstHit *first_hit = nullptr) const {
         Intersection inter;
 
         inter = scene.bvh_tree_.CheckIntersect(r, 0.001, infinity);
 
         if (!inter.happened_) {
-            return {0, 0, 0};
+            return scene.environment_.Emission(r.direction());
+        }
+
+        const Material *material = &scene.materials_[inter.material_id_];
+        if (first_hit) {
+            first_hit->albedo_ = material->GetAlbedo();
+            first_hit->normal_ = inter.normal_;
+            first_hit->depth_ = inter.t_;
         }
 
         // if hit light direction
-        if (inter.material_->HasEmission()) {
-            return inter.material_->GetEmission();
+        if (material->HasEmission()) {
+            return material->GetEmission();
         }
 
-        Vector3d L_dir{0, 0, 0}, L_indir{0, 0, 0};
+        Color3d radiance{0, 0, 0}, throughput{1, 1, 1};
+        Ray ray = r;
+        for (int depth = 1;; ++depth) {
+            Vector3d p = inter.p_;
+            Vector3d N = inter.normal_;
+            Vector3d w_o = -ray.direction();
 
-        // TO DO: sample from light
-        Intersection inter_light;
-        double pdf_light = 0.0;
-        scene.SampleLight(inter_light, pdf_light);
+            // sample from light
+            Intersection inter_light;
+            double pdf_light = 0.0;
+            scene.SampleLight(p, N, inter_light, pdf_light, sampler);
 
-        Vector3d p = inter.p_;
-        Vector3d N = inter.normal_;
-        Vector3d w_o = -r.direction();
+            Vector3d x = inter_light.p_;
+            Vector3d NN = inter_light.normal_;
 
-        Vector3d x = inter_light.p_;
-        Vector3d NN = inter_light.normal_;
+            Ray ligth_sample(p, Normalize(x - p));
+            Intersection light_inter = scene.bvh_tree_.CheckIntersect(ligth_sample, 0.001, infinity);
+            const Material &light_material = scene.materials_[light_inter.material_id_];
+            if (pdf_light > 0.0 && light_inter.happened_ && Length(light_inter.p_ - x) < eps && light_material.HasEmission()) {
+                Vector3d w_s = Normalize(x - p);
+                double dis = LengthSquared(x - p);
+                double cos_theta_1 = DotProduct(w_s, N);
+                double cos_theta_2 = DotProduct(-w_s, NN);
+                if (cos_theta_1 > 0 && cos_theta_2 > 0) {
+                    Vector3d fr = material->Eval(w_o, w_s, N);
+                    double weight = MisWeight(pdf_light * dis / cos_theta_2, material->Pdf(w_s, w_o, N));
+                    Vector3d L_dir = HadamardProduct(light_material.GetEmission(), fr) * cos_theta_1 * cos_theta_2 / dis / pdf_light;
+                    assert(L_dir.x() >= 0 && L_dir.y() >= 0 && L_dir.z() >= 0);
+                    radiance += HadamardProduct(throughput, L_dir) * weight;
+                }
+            }
 
-        Ray ligth_sample(p, Normalize(x - p));
-        Intersection light_inter = scene.bvh_tree_.CheckIntersect(ligth_sample, 0.001, infinity);
-        if (light_inter.happened_ && Length(light_inter.p_ - x) < eps && light_inter.material_->HasEmission()) {
-            Vector3d w_s = Normalize(x - p);
-            Vector3d fr = inter.material_->Eval(w_o, w_s, N);
-            double dis = LengthSquared(x - p);
-            double cos_theta_1 = DotProduct(w_s, N);
-            double cos_theta_2 = DotProduct(-w_s, NN);
-            if (cos_theta_1 * cos_theta_2 >= 0) {
-                L_dir = HadamardProduct(light_inter.material_->GetEmission(), fr) * cos_theta_1 * cos_theta_2 / dis / pdf_light;
+            // sample from the environment
+            if (!scene.environment_.Empty()) {
+                Vector3d w_e;
+                double pdf_environment = 0.0;
+                Color3d L_e = scene.environment_.Sample(sampler.Get2D(), w_e, pdf_environment);
+                double cos_theta_e = DotProduct(w_e, N);
+                if (pdf_environment > 0.0 && cos_theta_e > 0 && !scene.bvh_tree_.CheckIntersect(Ray(p, w_e), 0.001, infinity).happened_) {
+                    Vector3d fr = material->Eval(w_e, w_o, N);
+                    double weight = MisWeight(pdf_environment, material->Pdf(w_e, w_o, N));
+                    radiance += HadamardProduct(throughput, HadamardProduct(L_e, fr)) * (cos_theta_e / pdf_environment * weight);
+                }
             }
-            assert(L_dir.x() >= 0 && L_dir.y() >= 0 && L_dir.z() >= 0);
-        }
 
-        // Russian Roulette
-        if (TrRandom::Double() <= russian_roulette) {
-            Vector3d w_i = inter.material_->Sample(w_o, N);
+            // Russian Roulette
+            if ((max_depth_ > 0 && depth >= max_depth_) || sampler.Get1D() > russian_roulette) {
+                break;
+            }
+            Vector3d w_i = material->Sample(w_o, N, sampler);
+            double pdf = material->Pdf(w_i, w_o, N);
+            double cos_theta = DotProduct(w_i, N);
+            if (pdf <= eps || cos_theta <= 0) {
+                break;
+            }
+            Vector3d fr = material->Eval(w_i, w_o, N);
+            throughput = HadamardProduct(throughput, fr) * cos_theta / pdf / russian_roulette;
+            assert(throughput.x() >= 0 && throughput.y() >= 0 && throughput.z() >= 0);
+
             Ray next_ray(p, w_i);
             Intersection next_inter = scene.bvh_tree_.CheckIntersect(next_ray, 0.001, infinity);
-            if (next_inter.happened_ && !next_inter.material_->HasEmission()) {
-                double pdf = inter.material_->Pdf(w_i, w_o, N) + eps;
-                if (pdf > eps) {
-                    Vector3d fr = inter.material_->Eval(w_i, w_o, N);
-                    L_indir = HadamardProduct(CastRay(next_ray, scene, depth + 1), fr) * DotProduct(w_i, N) / pdf / russian_roulette;
-                    assert(L_indir.x() >= 0 && L_indir.y() >= 0 && L_indir.z() >= 0);
+            if (!next_inter.happened_) {
+                // escaped, weighted against the chance of sampling the environment there
+                if (!scene.environment_.Empty()) {
+                    radiance += HadamardProduct(throughput, scene.environment_.Emission(w_i)) * MisWeight(pdf, scene.environment_.Pdf(w_i));
+                }
+                break;
+            }
+
+            // an emitter hit by the BSDF sample ends the path, weighted against
+            // the chance that light sampling picked the same point
+            const Material *next_material = &scene.materials_[next_inter.material_id_];
+            if (next_material->HasEmission()) {
+                double cos_light = DotProduct(-w_i, next_inter.normal_);
+                if (cos_light > 0) {
+                    double pdf_light_solid_angle = scene.LightPdf(p, N, next_inter) * LengthSquared(next_inter.p_ - p) / cos_light;
+                    radiance += HadamardProduct(throughput, next_material->GetEmission()) * MisWeight(pdf, pdf_light_solid_angle);
                 }
+                break;
             }
+            ray = next_ray;
+            inter = next_inter;
+            material = next_material;
         }
-        return L_dir + L_indir;
+        return radiance;
     }
 
+    void SetMisHeuristic(MisHeuristic heuristic) { mis_heuristic_ = heuristic; }
+
 private:
+    // weight of a sample drawn with density pdf against another strategy that
+    // could have produced it with density other_pdf (both per solid angle)
+    double MisWeight(double pdf, double other_pdf) const {
+        if (mis_heuristic_ == kPOWER) {
+            pdf *= pdf;
+            other_pdf *= other_pdf;
+        }
+        return pdf + other_pdf > 0.0 ? pdf / (pdf + other_pdf) : 0.0;
+    }
+
+    // sums over the samples of one pixel; the half sums cover only odd samples
+    struct PixelSamples {
+        Color3d radiance_;
+        Color3d half_radiance_;
+        uint32_t half_count_ = 0;
+        FirstHit first_hits_;
+    };
+
+    PixelSamples SamplePixel(Scene &scene, int x, int y, int sample_begin, int sample_count) const {
+        int index = x * image_width_ + y;
+        PixelSamples samples;
+        Sampler sampler(sampler_type_, samples_per_pixel_);
+        for (int s = sample_begin; s < sample_begin + sample_count; ++s) {
+            sampler.StartSample(x, y, index, s);
+            Vector2d jitter = sampler.Get2D();
+            auto u = (y + jitter.x()) / (image_width_ - 1);
+            auto v = (x + jitter.y()) / (image_height_ - 1);
+            Ray r = scene.camera_.GetRay(u, v, sampler);
+            FirstHit first_hit;
+            Color3d sample_color = CastRay(r, scene, sampler, &first_hit);
+            samples.radiance_ += sample_color;
+            samples.first_hits_.albedo_ += first_hit.albedo_;
+            samples.first_hits_.normal_ += first_hit.normal_;
+            samples.first_hits_.depth_ += first_hit.depth_;
+            if (s & 1) {
+                samples.half_radiance_ += sample_color;
+                ++samples.half_count_;
+            }
+        }
+        return samples;
+    }
+
+    int NumTiles() const {
+        return ((image_width_ + tile_size - 1) / tile_size) * ((image_height_ + tile_size - 1) / tile_size);
+    }
+
+    void GetTileBounds(int tile, int &row_begin, int &row_end, int &column_begin, int &column_end) const {
+        int tiles_x = (image_width_ + tile_size - 1) / tile_size;
+        row_begin = tile / tiles_x * tile_size;
+        column_begin = tile % tiles_x * tile_size;
+        row_end = std::min(row_begin + tile_size, image_height_);
+        column_end = std::min(column_begin + tile_size, image_width_);
+    }
+
+    // Deactivate tiles whose mean pixel error is below the threshold, and return
+    // the number of pixels that keep sampling.
+    long long UpdateActiveTiles(const AccumulationBuffer &buffer, std::vector<char> &active_tiles, double threshold) const {
+        long long active_pixels = 0;
+        for (int tile = 0; tile < static_cast<int>(active_tiles.size()); ++tile) {
+            if (!active_tiles[tile]) {
+                continue;
+            }
+            int row_begin, row_end, column_begin, column_end;
+            GetTileBounds(tile, row_begin, row_end, column_begin, column_end);
+            double error = 0.0;
+            for (int x = row_begin; x < row_end; ++x) {
+                for (int y = column_begin; y < column_end; ++y) {
+                    error += buffer.PixelError(x * image_width_ + y);
+                }
+            }
+            int tile_pixels = (row_end - row_begin) * (column_end - column_begin);
+            if (error / tile_pixels < threshold) {
+                active_tiles[tile] = 0;
+            } else {
+                active_pixels += tile_pixels;
+            }
+        }
+        return active_pixels;
+    }
+
     int image_width_;
     int image_height_;
     int samples_per_pixel_;
     int max_depth_;
+    Sampler::SamplerType sampler_type_;
+    MisHeuristic mis_heuristic_;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,303 @@
+#ifndef TR_INCLUDE_SAMPLER_H
+#define TR_INCLUDE_SAMPLER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "base.hpp"
+
+// Source of the uniform numbers consumed by one pixel sample: pixel jitter, lens
+// position, light and BSDF samples and russian roulette. Every Get1D/Get2D call
+// advances to the next dimension, so the same dimension of consecutive samples
+// of a pixel comes from one well-distributed sequence.
+//
+// Each point depends only on the pixel, the sample index and the dimension,
+// like the random streams seeded by TrRandom::SeedSample, so disjoint sample
+// ranges can still be rendered separately and merged.
+//
+//   kRANDOM      independent PCG numbers (the renderer's original sampling)
+//   kSTRATIFIED  one jittered stratum per sample in every dimension (Latin
+//                hypercube) over blocks of samples_per_pixel samples
+//   kHALTON      Halton sequence, one prime base per dimension, with a
+//                per-pixel Cranley-Patterson rotation
+//   kSOBOL       Sobol (0,2)-sequence pairs, Owen-scrambled per pixel and
+//                dimension (Burley, "Practical Hash-based Owen Scrambling")
+//   kBLUE_NOISE  the same Sobol pairs scrambled alike for every pixel and
+//                rotated per pixel by a blue-noise mask, so the remaining error
+//                is spread as high-frequency noise between pixels
+class Sampler {
+public:
+    enum SamplerType { kRANDOM,
+                       kSTRATIFIED,
+                       kHALTON,
+                       kSOBOL,
+                       kBLUE_NOISE };
+
+    Sampler(SamplerType type, int samples_per_pixel)
+        : type_(type), strata_(samples_per_pixel > 0 ? samples_per_pixel : 16), row_(0), column_(0), pixel_seed_(0), sample_index_(0), dimension_(0) {}
+
+    void StartSample(int row, int column, uint64_t pixel_index, uint32_t sample_index);
+
+    double Get1D();
+
+    Vector2d Get2D();
+
+private:
+    static const int kBlueNoiseSize = 64;
+    static const int kNumPrimes = 32;
+
+    uint64_t DimensionSeed(int dimension) const {
+        return TrRandom::MixBits(pixel_seed_ ^ (0x9e3779b97f4a7c15ULL * (dimension + 1)));
+    }
+
+    static double ToDouble(uint32_t bits) { return bits * 0x1p-32; }
+
+    double Stratified(int dimension) const;
+    double Halton(int dimension) const;
+    Vector2d Sobol(uint64_t seed) const;
+    Vector2d BlueNoise(int dimension) const;
+
+    static uint32_t ReverseBits(uint32_t x);
+    static uint32_t NestedUniformScramble(uint32_t x, uint32_t seed);
+    static uint32_t SobolSample(uint32_t index, int dimension);
+    static uint32_t Permute(uint32_t i, uint32_t length, uint32_t seed);
+    static const std::vector<float> &BlueNoiseMask();
+
+    SamplerType type_;
+    uint32_t strata_;
+    int row_;
+    int column_;
+    uint64_t pixel_seed_;
+    uint32_t sample_index_;
+    int dimension_;
+};
+
+bool ParseSamplerType(const std::string &name, Sampler::SamplerType &type) {
+    if (name == "random") {
+        type = Sampler::kRANDOM;
+    } else if (name == "stratified") {
+        type = Sampler::kSTRATIFIED;
+    } else if (name == "halton") {
+        type = Sampler::kHALTON;
+    } else if (name == "sobol") {
+        type = Sampler::kSOBOL;
+    } else if (name == "bluenoise") {
+        type = Sampler::kBLUE_NOISE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void Sampler::StartSample(int row, int column, uint64_t pixel_index, uint32_t sample_index) {
+    row_ = row;
+    column_ = column;
+    pixel_seed_ = TrRandom::MixBits(pixel_index);
+    sample_index_ = sample_index;
+    dimension_ = 0;
+    if (type_ == kRANDOM) {
+        TrRandom::SeedSample(pixel_index, sample_index);
+    }
+}
+
+double Sampler::Get1D() {
+    int dimension = dimension_++;
+    switch (type_) {
+    case kRANDOM:
+        return TrRandom::Double();
+    case kSTRATIFIED:
+        return Stratified(dimension);
+    case kHALTON:
+        return Halton(dimension);
+    case kSOBOL:
+        return Sobol(DimensionSeed(dimension)).x();
+    case kBLUE_NOISE:
+        return BlueNoise(dimension).x();
+    }
+    return 0.0;
+}
+
+Vector2d Sampler::Get2D() {
+    int dimension = dimension_;
+    dimension_ += 2;
+    switch (type_) {
+    case kRANDOM: {
+        double u = TrRandom::Double();
+        return Vector2d(u, TrRandom::Double());
+    }
+    case kSTRATIFIED:
+        return Vector2d(Stratified(dimension), Stratified(dimension + 1));
+    case kHALTON:
+        return Vector2d(Halton(dimension), Halton(dimension + 1));
+    case kSOBOL:
+        return Sobol(DimensionSeed(dimension));
+    case kBLUE_NOISE:
+        return BlueNoise(dimension);
+    }
+    return {0.0, 0.0};
+}
+
+double Sampler::Stratified(int dimension) const {
+    // every block of strata_ samples visits each stratum once, in a shuffled order
+    uint32_t block = sample_index_ / strata_;
+    uint64_t seed = TrRandom::MixBits(DimensionSeed(dimension) + block);
+    uint32_t stratum = Permute(sample_index_ % strata_, strata_, static_cast<uint32_t>(seed));
+    double jitter = ToDouble(static_cast<uint32_t>(TrRandom::MixBits(seed ^ sample_index_) >> 32));
+    return (stratum + jitter) / strata_;
+}
+
+double Sampler::Halton(int dimension) const {
+    static const uint32_t primes[kNumPrimes] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+                                                59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131};
+    if (dimension >= kNumPrimes) {
+        // deep path vertices gain little from large bases, so they get random numbers
+        return ToDouble(static_cast<uint32_t>(TrRandom::MixBits(DimensionSeed(dimension) ^ sample_index_) >> 32));
+    }
+    uint32_t base = primes[dimension];
+    double rotation = ToDouble(static_cast<uint32_t>(DimensionSeed(dimension) >> 32));
+    double inverse_base = 1.0 / base, digit_weight = inverse_base, radical_inverse = 0.0;
+    for (uint32_t index = sample_index_; index > 0; index /= base) {
+        radical_inverse += (index % base) * digit_weight;
+        digit_weight *= inverse_base;
+    }
+    double value = radical_inverse + rotation;
+    return value < 1.0 ? value : value - 1.0;
+}
+
+Vector2d Sampler::Sobol(uint64_t seed) const {
+    uint32_t index = NestedUniformScramble(sample_index_, static_cast<uint32_t>(seed));
+    uint32_t x = NestedUniformScramble(SobolSample(index, 0), static_cast<uint32_t>(seed >> 32));
+    uint32_t y = NestedUniformScramble(SobolSample(index, 1), static_cast<uint32_t>(TrRandom::MixBits(seed)));
+    return Vector2d(ToDouble(x), ToDouble(y));
+}
+
+Vector2d Sampler::BlueNoise(int dimension) const {
+    // the scramble seed ignores the pixel, so only the mask tells pixels apart
+    uint64_t seed = TrRandom::MixBits(0x9e3779b97f4a7c15ULL * (dimension + 1));
+    Vector2d point = Sobol(seed);
+
+    // each component reads the mask at its own toroidal offset
+    for (int c = 0; c < 2; ++c) {
+        uint64_t offset = TrRandom::MixBits(seed + c);
+        int mask_row = (row_ + static_cast<int>(offset & (kBlueNoiseSize - 1))) & (kBlueNoiseSize - 1);
+        int mask_column = (column_ + static_cast<int>((offset >> 8) & (kBlueNoiseSize - 1))) & (kBlueNoiseSize - 1);
+        point(c) += BlueNoiseMask()[mask_row * kBlueNoiseSize + mask_column];
+        if (point(c) >= 1.0) {
+            point(c) -= 1.0;
+        }
+    }
+    return point;
+}
+
+uint32_t Sampler::ReverseBits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Owen scrambling by a Laine-Karras style hash on the reversed bits: each bit is
+// flipped depending only on the bits above it.
+uint32_t Sampler::NestedUniformScramble(uint32_t x, uint32_t seed) {
+    x = ReverseBits(x);
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return ReverseBits(x);
+}
+
+// the first two Sobol dimensions: van der Corput, and the one from x + 1
+uint32_t Sampler::SobolSample(uint32_t index, int dimension) {
+    if (dimension == 0) {
+        return ReverseBits(index);
+    }
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+// element i of a pseudo-random permutation of [0, length) chosen by seed
+// (Kensler, "Correlated Multi-Jittered Sampling")
+uint32_t Sampler::Permute(uint32_t i, uint32_t length, uint32_t seed) {
+    uint32_t mask = length - 1;
+    mask |= mask >> 1;
+    mask |= mask >> 2;
+    mask |= mask >> 4;
+    mask |= mask >> 8;
+    mask |= mask >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893du;
+        i ^= seed >> 16;
+        i ^= (i & mask) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fu;
+        i ^= seed >> 23;
+        i ^= (i & mask) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & mask) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & mask) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & mask) >> 2;
+        i *= 0xc860a3dfu;
+        i &= mask;
+        i ^= i >> 5;
+    } while (i >= length);
+    return (i + seed) % length;
+}
+
+// Tileable mask of kBlueNoiseSize^2 values in [0, 1) whose neighbours differ
+// as much as possible, built on first use by ranking pixels in the order the
+// void-and-cluster method (Ulichney 1993) fills the largest void: each step
+// takes the empty pixel with the lowest Gaussian-weighted energy of the pixels
+// ranked so far.
+const std::vector<float> &Sampler::BlueNoiseMask() {
+    static const std::vector<float> mask = []() {
+        const int size = kBlueNoiseSize, num_pixels = size * size;
+        const double sigma = 1.9;
+
+        std::vector<double> kernel(num_pixels);
+        for (int dy = 0; dy < size; ++dy) {
+            for (int dx = 0; dx < size; ++dx) {
+                int wx = std::min(dx, size - dx), wy = std::min(dy, size - dy);
+                kernel[dy * size + dx] = std::exp(-(wx * wx + wy * wy) / (2.0 * sigma * sigma));
+            }
+        }
+
+        std::vector<double> energy(num_pixels, 0.0);
+        std::vector<float> ranks(num_pixels, -1.0f);
+        for (int rank = 0; rank < num_pixels; ++rank) {
+            int best = -1;
+            for (int p = 0; p < num_pixels; ++p) {
+                if (ranks[p] < 0.0f && (best < 0 || energy[p] < energy[best])) {
+                    best = p;
+                }
+            }
+            ranks[best] = (rank + 0.5f) / num_pixels;
+            int bx = best % size, by = best / size;
+            for (int y = 0; y < size; ++y) {
+                const double *kernel_row = &kernel[((y - by + size) & (size - 1)) * size];
+                for (int x = 0; x < size; ++x) {
+                    energy[y * size + x] += kernel_row[(x - bx + size) & (size - 1)];
+                }
+            }
+        }
+        return ranks;
+    }();
+    return mask;
+}
+
+#endif
@@ -1,8 +1,11 @@
 #ifndef TR_INCLUDE_SCENE_H
 #define TR_INCLUDE_SCENE_H
 
-#include "BVH.hpp"
+#include "arena.hpp"
 #include "base.hpp"
+#include "environment_light.hpp"
+#include "light_bvh.hpp"
+#include "primitive_bvh.hpp"
 
 class Scene {
 
@@ -19,45 +22,88 @@ public:
         list_.insert(list_.end(), object_list.begin(), object_list.end());
     }
 
+    MaterialId AddMaterial(const Material &material) {
+        return materials_.Add(material);
+    }
+
+    // where loaders put geometry that lives as long as the scene
+    const std::shared_ptr<Arena> &GetArena() const {
+        return arena_;
+    }
+
+    void SetEnvironment(const EnvironmentLight &environment) {
+        environment_ = environment;
+    }
+
+    // takes effect at the next InitializeBvh
+    void SetTriangleIntersector(TriangleIntersector intersector) {
+        triangle_intersector_ = intersector;
+    }
+
     void SetCamera(const Camera &cam_) {
         camera_ = cam_;
     }
 
     void InitializeBvh() {
-        bvh_tree_ = Bvh::BvhTree(list_);
+        bvh_tree_ = Bvh::PrimitiveBvh(list_, arena_.get(), triangle_intersector_);
+
+        // the emitters as the tree lists them, which are the primitives hits point to
+        std::vector<const Object *> primitives, lights;
+        std::vector<double> radiance;
+        bvh_tree_.GetPrimitives(primitives);
+        for (const Object *primitive : primitives) {
+            const Material &material = materials_[primitive->GetMaterial()];
+            if (material.HasEmission()) {
+                Color3d emission = material.GetEmission();
+                lights.push_back(primitive);
+                radiance.push_back((emission.x() + emission.y() + emission.z()) / 3);
+            }
+        }
+        light_bvh_ = LightBvh(lights, radiance);
         initialized_ = true;
     }
 
-    Bvh::BvhTree GetBvhTree() {
+    const Bvh::PrimitiveBvh &GetBvhTree() const {
         return bvh_tree_;
     }
 
-    void SampleLight(Intersection &inter, double &pdf);
+    // Pick a point on the emitters for shading point p with normal n, choosing
+    // the emitter through the light BVH and the point as seen from p. pdf is
+    // per unit area, 0 if no emitter can light p.
+    void SampleLight(const Point3d &p, const Vector3d &n, Intersection &inter, double &pdf, Sampler &sampler) const;
+
+    // the area density with which SampleLight returns the emitter point hit
+    double LightPdf(const Point3d &p, const Vector3d &n, const Intersection &hit) const {
+        if (!hit.object_ || !materials_[hit.material_id_].HasEmission()) {
+            return 0.0;
+        }
+        return light_bvh_.Pmf(p, n, hit.object_) * hit.object_->Pdf(p, hit.p_);
+    }
 
 public:
+    // first, so it outlives everything allocated from it
+    std::shared_ptr<Arena> arena_ = std::make_shared<Arena>();
     ObjectListType list_;
-    Bvh::BvhTree bvh_tree_;
+    MaterialTable materials_;
+    Bvh::PrimitiveBvh bvh_tree_;
+    TriangleIntersector triangle_intersector_ = kWATERTIGHT;
     Camera camera_;
     bool initialized_;
+    LightBvh light_bvh_;
+    // lights rays that leave the scene; empty for a black background
+    EnvironmentLight environment_;
 };
 
-void Scene::SampleLight(Intersection &inter, double &pdf) {
-    double sum_emit_area = 0.0;
-    for (const auto &object : list_) {
-        if (object->GetMaterial()->HasEmission()) {
-            sum_emit_area += object->GetArea();
-        }
-    }
-    double random_pick = TrRandom::Double() * sum_emit_area;
-    for (const auto &object : list_) {
-        if (object->GetMaterial()->HasEmission()) {
-            if (random_pick < object->GetArea()) {
-                object->Sample(inter, pdf);
-                return;
-            }
-            random_pick -= object->GetArea();
-        }
+void Scene::SampleLight(const Point3d &p, const Vector3d &n, Intersection &inter, double &pdf, Sampler &sampler) const {
+    double pmf = 0.0;
+    const Object *light = light_bvh_.Sample(p, n, sampler.Get1D(), pmf);
+    if (!light) {
+        pdf = 0.0;
+        return;
     }
+    light->Sample(p, inter, pdf, sampler);
+    // times the chance of picking this emitter
+    pdf *= pmf;
 }
 
 #endif
\ No newline at end of file
@@ -1,24 +1,38 @@
 #ifndef TR_INCLUDE_SPHERE_H
 #define TR_INCLUDE_SPHERE_H
 
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "arena.hpp"
 #include "base.hpp"
 #include "bounding_box.hpp"
 #include "material.hpp"
 #include "object.hpp"
+#include "object_list.hpp"
 
 class Sphere : public Object {
 public:
     Sphere() {}
-    Sphere(Point3d cen, double r, shared_ptr<Material> m)
+    Sphere(Point3d cen, double r, MaterialId m)
         : center_(cen), radius_(r), material_(m){};
 
     virtual Intersection Intersect(const Ray &r, double t_min, double t_max) const override;
     virtual BoundingBox GetBoundingBox() const override;
+    virtual void Sample(Intersection &inter, double &pdf, Sampler &sampler) const override;
+
+    virtual double GetArea() const override { return 4.0 * pi * radius_ * radius_; }
+    virtual MaterialId GetMaterial() const override { return material_; }
+
+    // the intersection record for a hit found at t by another intersection test
+    Intersection HitAt(const Ray &r, double t) const;
 
 public:
     Point3d center_;
+    // negative for a hollow sphere, whose normals point inwards
     double radius_;
-    shared_ptr<Material> material_;
+    MaterialId material_;
 };
 
 Intersection Sphere::Intersect(const Ray &r, double t_min, double t_max) const {
@@ -41,14 +55,18 @@ Intersection Sphere::Intersect(const Ray &r, double t_min, double t_max) const {
             return ret_intersection;
         }
     }
+    return HitAt(r, root);
+}
 
+Intersection Sphere::HitAt(const Ray &r, double t) const {
+    Intersection ret_intersection;
     ret_intersection.happened_ = true;
-    ret_intersection.t_ = root;
-    ret_intersection.p_ = r.at(root);
+    ret_intersection.t_ = t;
+    ret_intersection.p_ = r.at(t);
     Vector3d outward_normal_ = (ret_intersection.p_ - center_) / radius_;
     ret_intersection.SetFaceNormal(r, outward_normal_);
-    ret_intersection.material_ = material_;
-
+    ret_intersection.material_id_ = material_;
+    ret_intersection.object_ = this;
     return ret_intersection;
 }
 
@@ -58,4 +76,104 @@ BoundingBox Sphere::GetBoundingBox() const {
                        center_ + Vector3d(r, r, r));
 }
 
-#endif
\ No newline at end of file
+// uniform over the surface
+void Sphere::Sample(Intersection &inter, double &pdf, Sampler &sampler) const {
+    Vector3d direction = SampleUnitSphere(sampler.Get2D());
+    inter.p_ = center_ + direction * fabs(radius_);
+    inter.normal_ = radius_ < 0 ? -direction : direction;
+    pdf = 1.0 / GetArea();
+}
+
+// Many spheres, such as the particles of a simulation, in one array with no
+// per-sphere heap block or reference count. Given an arena the array lives in
+// it. A scene's BVH takes the spheres one by one through GetPrimitives and
+// packs them for vector tests; Intersect on the set itself tests every sphere
+// and is only meant for small sets used on their own.
+class SphereSet : public Object {
+public:
+    // one material for all spheres, or one per sphere
+    SphereSet(const std::vector<Point3d> &centers, const std::vector<double> &radii, const std::vector<MaterialId> &materials,
+              const std::shared_ptr<Arena> &arena = nullptr)
+        : arena_(arena), spheres_(ArenaAllocator<Sphere>(arena.get())) {
+        spheres_.reserve(centers.size());
+        surface_area_ = 0.0;
+        for (size_t i = 0; i < centers.size(); ++i) {
+            spheres_.emplace_back(centers[i], radii[i], materials[materials.size() == 1 ? 0 : i]);
+            surface_area_ += spheres_.back().GetArea();
+            box_ = i == 0 ? spheres_.back().GetBoundingBox() : MergeBoxes(box_, spheres_.back().GetBoundingBox());
+        }
+    }
+
+    virtual Intersection Intersect(const Ray &r, double t_min, double t_max) const override;
+    virtual BoundingBox GetBoundingBox() const override { return box_; }
+    virtual void Sample(Intersection &inter, double &pdf, Sampler &sampler) const override;
+
+    virtual double GetArea() const override { return surface_area_; }
+    // the first sphere's; each sphere has its own
+    virtual MaterialId GetMaterial() const override { return spheres_.empty() ? 0 : spheres_.front().GetMaterial(); }
+
+    virtual void GetPrimitives(std::vector<const Object *> &primitives) const override {
+        for (const Sphere &sphere : spheres_) {
+            primitives.push_back(&sphere);
+        }
+    }
+
+    size_t Size() const { return spheres_.size(); }
+
+public:
+    std::shared_ptr<Arena> arena_;
+
+    std::vector<Sphere, ArenaAllocator<Sphere>> spheres_;
+
+    BoundingBox box_;
+
+    double surface_area_;
+};
+
+Intersection SphereSet::Intersect(const Ray &r, double t_min, double t_max) const {
+    Intersection ret_intersection;
+    for (const Sphere &sphere : spheres_) {
+        Intersection cur_intersection = sphere.Sphere::Intersect(r, t_min, t_max);
+        if (cur_intersection.happened_) {
+            t_max = cur_intersection.t_;
+            ret_intersection = cur_intersection;
+        }
+    }
+    return ret_intersection;
+}
+
+void SphereSet::Sample(Intersection &inter, double &pdf, Sampler &sampler) const {
+    double tmp_p = sampler.Get1D() * GetArea();
+    for (const Sphere &sphere : spheres_) {
+        if (sphere.GetArea() > tmp_p) {
+            sphere.Sample(inter, pdf, sampler);
+            // times the chance of picking this sphere
+            pdf *= sphere.GetArea() / GetArea();
+            return;
+        }
+        tmp_p -= sphere.GetArea();
+    }
+}
+
+// Read spheres from a text file with one "x y z radius" per line, all of the
+// given material.
+bool LoadSphereSet(const std::string &filename, MaterialId material, const std::shared_ptr<Arena> &arena, ObjectPtrType &sphere_set) {
+    std::ifstream ifs(filename);
+    if (!ifs) {
+        return false;
+    }
+    std::vector<Point3d> centers;
+    std::vector<double> radii;
+    double x, y, z, radius;
+    while (ifs >> x >> y >> z >> radius) {
+        centers.emplace_back(x, y, z);
+        radii.push_back(radius);
+    }
+    if (!ifs.eof() || centers.empty()) {
+        return false;
+    }
+    sphere_set = std::make_shared<SphereSet>(centers, radii, std::vector<MaterialId>{material}, arena);
+    return true;
+}
+
+#endif
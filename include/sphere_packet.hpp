@@ -0,0 +1,97 @@
+#ifndef TR_INCLUDE_SPHERE_PACKET_H
+#define TR_INCLUDE_SPHERE_PACKET_H
+
+#include "base.hpp"
+#include "packet.hpp"
+
+// Up to kPacketWidth spheres in single precision, stored as structure of
+// arrays so one test runs on all lanes at once. Unused lanes have radius 0
+// and are never hit.
+struct alignas(32) SpherePacket {
+    // centre by axis
+    float centers_[3][kPacketWidth];
+    float radii_[kPacketWidth];
+    // the sphere in lane 0; the other lanes hold the ones after it
+    int first_;
+
+    SpherePacket() {}
+    SpherePacket(int first) : centers_(), radii_(), first_(first) {}
+
+    void Set(int lane, const Point3d &center, double radius) {
+        for (int k = 0; k < 3; ++k) {
+            centers_[k][lane] = static_cast<float>(center(k));
+        }
+        radii_[lane] = static_cast<float>(fabs(radius));
+    }
+
+    // Lane of the nearest hit in (t_min, t_max), entering or leaving, or -1.
+    // Sets t to its distance.
+    int Intersect(const PacketRay &r, float t_min, float t_max, float &t) const;
+};
+
+// The discriminant is taken from the distance between the centre and the
+// ray's closest point to it rather than as b^2 - ac, which keeps small
+// spheres far from the origin from cancelling away in single precision.
+#if defined(__SSE2__)
+
+int SpherePacket::Intersect(const PacketRay &r, float t_min, float t_max, float &t) const {
+    const float *d = r.direction_;
+    float a = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+    PacketFloat dx = PacketSet(d[0]), dy = PacketSet(d[1]), dz = PacketSet(d[2]), inv_a = PacketSet(1.0f / a);
+    // origin relative to the centres
+    PacketFloat fx = PacketSet(r.origin_[0]) - PacketLoad(centers_[0]);
+    PacketFloat fy = PacketSet(r.origin_[1]) - PacketLoad(centers_[1]);
+    PacketFloat fz = PacketSet(r.origin_[2]) - PacketLoad(centers_[2]);
+    PacketFloat radius = PacketLoad(radii_);
+    // the closest point is at t = -hb / a
+    PacketFloat hb = fx * dx + fy * dy + fz * dz;
+    PacketFloat s = hb * inv_a;
+    PacketFloat lx = fx - s * dx, ly = fy - s * dy, lz = fz - s * dz;
+    PacketFloat discriminant = PacketSet(a) * (radius * radius - (lx * lx + ly * ly + lz * lz));
+    PacketFloat hit = PacketAnd(PacketGreater(discriminant, PacketSet(0.0f)), PacketGreater(radius, PacketSet(0.0f)));
+    if (!PacketMask(hit)) {
+        return -1;
+    }
+    PacketFloat root = PacketSqrt(PacketSelect(hit, discriminant, PacketSet(0.0f)));
+    PacketFloat near = (PacketSet(0.0f) - hb - root) * inv_a, far = (root - hb) * inv_a;
+    PacketFloat t_min_lanes = PacketSet(t_min);
+    PacketFloat t_lanes = PacketSelect(PacketGreater(near, t_min_lanes), near, far);
+    hit = PacketAnd(hit, PacketAnd(PacketGreater(t_lanes, t_min_lanes), PacketGreater(PacketSet(t_max), t_lanes)));
+
+    int nearest = PacketNearest(hit, t_lanes, t_max);
+    t = t_max;
+    return nearest;
+}
+
+#else
+
+int SpherePacket::Intersect(const PacketRay &r, float t_min, float t_max, float &t) const {
+    const float *d = r.direction_;
+    float a = d[0] * d[0] + d[1] * d[1] + d[2] * d[2], inv_a = 1.0f / a;
+    int nearest = -1;
+    for (int lane = 0; lane < kPacketWidth; ++lane) {
+        float f[3] = {r.origin_[0] - centers_[0][lane], r.origin_[1] - centers_[1][lane], r.origin_[2] - centers_[2][lane]};
+        float hb = f[0] * d[0] + f[1] * d[1] + f[2] * d[2];
+        float s = hb * inv_a;
+        float l[3] = {f[0] - s * d[0], f[1] - s * d[1], f[2] - s * d[2]};
+        float discriminant = a * (radii_[lane] * radii_[lane] - (l[0] * l[0] + l[1] * l[1] + l[2] * l[2]));
+        if (!(discriminant > 0.0f) || !(radii_[lane] > 0.0f)) {
+            continue;
+        }
+        float root = std::sqrt(discriminant);
+        float t_lane = (-hb - root) * inv_a;
+        if (!(t_lane > t_min)) {
+            t_lane = (root - hb) * inv_a;
+        }
+        if (t_lane > t_min && t_lane < t_max) {
+            t_max = t_lane;
+            nearest = lane;
+        }
+    }
+    t = t_max;
+    return nearest;
+}
+
+#endif
+
+#endif
@@ -3,19 +3,21 @@
 
 #include <array>
 #include <string>
+#include <vector>
 
-#include "BVH.hpp"
 #include "OBJ_Loader.hpp"
+#include "arena.hpp"
 #include "base.hpp"
 #include "bounding_box.hpp"
 #include "material.hpp"
 #include "object.hpp"
 #include "object_list.hpp"
+#include "quad.hpp"
 
 class Triangle : public Object {
 public:
     Triangle() {}
-    Triangle(Vector3d v0, Vector3d v1, Vector3d v2, shared_ptr<Material> m)
+    Triangle(Vector3d v0, Vector3d v1, Vector3d v2, MaterialId m)
         : vertex_coords_({v0, v1, v2}), material_(m) {
         edges_[0] = v1 - v0;
         edges_[1] = v2 - v0;
@@ -27,16 +29,41 @@ public:
 
     virtual Intersection Intersect(const Ray &r, double t_min, double t_max) const override;
     virtual BoundingBox GetBoundingBox() const override;
-    virtual void Sample(Intersection &inter, double &pdf) const override;
+    virtual void Sample(Intersection &inter, double &pdf, Sampler &sampler) const override;
+    virtual void Sample(const Point3d &ref, Intersection &inter, double &pdf, Sampler &sampler) const override;
+    virtual double Pdf(const Point3d &ref, const Point3d &p) const override;
 
     virtual double GetArea() const override { return surface_area_; }
-    virtual MaterialPtrType GetMaterial() const override { return material_; }
+    virtual MaterialId GetMaterial() const override { return material_; }
+
+    virtual void GetNormalCone(Vector3d &axis, double &cos_theta) const override {
+        axis = normal_;
+        cos_theta = 1.0;
+    }
+
+    const std::array<Point3d, 3> &GetVertices() const { return vertex_coords_; }
+
+    // the intersection record for a hit found at t by another intersection test
+    Intersection HitAt(const Ray &r, double t) const;
+
+    // distance along r to the plane of the triangle
+    double PlaneDistance(const Ray &r) const {
+        return DotProduct(normal_, vertex_coords_[0] - r.origin()) / DotProduct(normal_, r.direction());
+    }
 
 private:
+    // Below this solid angle the spherical triangle is too thin to sample
+    // accurately, and for a distant triangle area sampling is as good anyway.
+    // Above the maximum ref sits almost on the triangle.
+    static constexpr double kMinSolidAngle = 3e-4;
+    static constexpr double kMaxSolidAngle = 6.22;
+
+    // solid angle sampled from ref, or 0 where ref falls back to area sampling
+    double SamplingSolidAngle(const Point3d &ref) const;
+
     std::array<Point3d, 3> vertex_coords_;
     std::array<Vector3d, 2> edges_;
-    std::array<Point3d, 3> texture_coords_;
-    shared_ptr<Material> material_;
+    MaterialId material_;
     Vector3d normal_;
 
     double surface_area_;
@@ -60,13 +87,17 @@ Intersection Triangle::Intersect(const Ray &r, double t_min, double t_max) const
     if (v < 0 || u + v > 1) return ret_intersection;
     t_tmp = DotProduct(edges_[1], qvec) * det_inv;
     if (t_tmp <= t_min || t_tmp >= t_max) return ret_intersection;
-    // TODO find ray triangle intersection
+    return HitAt(r, t_tmp);
+}
 
+Intersection Triangle::HitAt(const Ray &r, double t) const {
+    Intersection ret_intersection;
     ret_intersection.happened_ = true;
-    ret_intersection.p_ = r.at(t_tmp);
-    ret_intersection.t_ = t_tmp;
+    ret_intersection.p_ = r.at(t);
+    ret_intersection.t_ = t;
     ret_intersection.normal_ = this->normal_;
-    ret_intersection.material_ = material_;
+    ret_intersection.material_id_ = material_;
+    ret_intersection.object_ = this;
     return ret_intersection;
 }
 
@@ -74,83 +105,319 @@ BoundingBox Triangle::GetBoundingBox() const {
     return MergeBoxes(BoundingBox(vertex_coords_[0], vertex_coords_[1]), BoundingBox(vertex_coords_[2]));
 }
 
-void Triangle::Sample(Intersection &inter, double &pdf) const {
-    double x = std::sqrt(TrRandom::Double()), y = TrRandom::Double();
+void Triangle::Sample(Intersection &inter, double &pdf, Sampler &sampler) const {
+    Vector2d u = sampler.Get2D();
+    double x = std::sqrt(u.x()), y = u.y();
     inter.p_ = vertex_coords_[0] * (1.0 - x) + vertex_coords_[1] * (x * (1.0 - y)) + vertex_coords_[2] * (x * y);
     inter.normal_ = normal_;
     pdf = 1.0 / surface_area_;
 }
 
+// uniform in the solid angle the triangle subtends from ref, so a large emitter
+// close to ref is not dominated by samples far across it
+void Triangle::Sample(const Point3d &ref, Intersection &inter, double &pdf, Sampler &sampler) const {
+    double solid_angle = SamplingSolidAngle(ref);
+    if (solid_angle == 0.0) {
+        Sample(inter, pdf, sampler);
+        return;
+    }
+    Vector3d w = SampleSphericalTriangle(Normalize(vertex_coords_[0] - ref), Normalize(vertex_coords_[1] - ref),
+                                         Normalize(vertex_coords_[2] - ref), sampler.Get2D());
+    // ref is in front, so w runs against the normal into the triangle's plane
+    double cos_light = -DotProduct(w, normal_);
+    if (cos_light <= 0.0) {
+        pdf = 0.0;
+        return;
+    }
+    double t = DotProduct(ref - vertex_coords_[0], normal_) / cos_light;
+    inter.p_ = ref + t * w;
+    inter.normal_ = normal_;
+    // 1 / solid_angle per steradian, converted to per unit area
+    pdf = cos_light / (t * t * solid_angle);
+}
+
+double Triangle::Pdf(const Point3d &ref, const Point3d &p) const {
+    double solid_angle = SamplingSolidAngle(ref);
+    if (solid_angle == 0.0) {
+        return 1.0 / surface_area_;
+    }
+    double distance_sqr = LengthSquared(p - ref);
+    double cos_light = fabs(DotProduct(p - ref, normal_)) / sqrt(distance_sqr);
+    return cos_light / (distance_sqr * solid_angle);
+}
+
+double Triangle::SamplingSolidAngle(const Point3d &ref) const {
+    // behind the triangle nothing is lit, so any pdf will do
+    if (DotProduct(ref - vertex_coords_[0], normal_) <= 0.0) {
+        return 0.0;
+    }
+    double solid_angle = SphericalTriangleArea(Normalize(vertex_coords_[0] - ref), Normalize(vertex_coords_[1] - ref),
+                                               Normalize(vertex_coords_[2] - ref));
+    return solid_angle < kMinSolidAngle || solid_angle > kMaxSolidAngle ? 0.0 : solid_angle;
+}
+
+// How the scene BVH tests rays against triangles. Möller-Trumbore needs
+// nothing beyond the triangles; the other two keep a precomputed record per
+// triangle next to them.
+//   kMOLLER_TRUMBORE  Triangle::Intersect, setting up edges and a division per test
+//   kAFFINE           a transform to unit-triangle space, three dot products and a
+//                     division per test (Woop's unit triangle test)
+//   kWATERTIGHT       shear to ray space set up once per ray, with no hits lost or
+//                     doubled along shared edges (Woop, Benthin and Wald,
+//                     "Watertight Ray/Triangle Intersection", 2013)
+//   kSIMD             Möller-Trumbore on a whole leaf at once, with the leaf's
+//                     triangles packed into single precision vector lanes
+enum TriangleIntersector { kMOLLER_TRUMBORE,
+                           kAFFINE,
+                           kWATERTIGHT,
+                           kSIMD };
+
+bool ParseTriangleIntersector(const std::string &name, TriangleIntersector &intersector) {
+    if (name == "moller") {
+        intersector = kMOLLER_TRUMBORE;
+    } else if (name == "affine") {
+        intersector = kAFFINE;
+    } else if (name == "watertight") {
+        intersector = kWATERTIGHT;
+    } else if (name == "simd") {
+        intersector = kSIMD;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Rows of the affine map taking a triangle to the unit triangle (0,0), (1,0),
+// (0,1) in the z = 0 plane, with z along its normal.
+struct AffineTriangleRecord {
+    Vector3d rows_[3];
+    double offsets_[3];
+
+    AffineTriangleRecord() {}
+    AffineTriangleRecord(const std::array<Point3d, 3> &v) {
+        Vector3d e0 = v[1] - v[0], e1 = v[2] - v[0], n = CrossProduct(e0, e1);
+        // inverse of the matrix with columns e0, e1, n; its determinant is |n|^2
+        double inv_det = 1.0 / LengthSquared(n);
+        rows_[0] = CrossProduct(e1, n) * inv_det;
+        rows_[1] = CrossProduct(n, e0) * inv_det;
+        rows_[2] = n * inv_det;
+        for (int i = 0; i < 3; ++i) {
+            offsets_[i] = -DotProduct(rows_[i], v[0]);
+        }
+    }
+
+    // front faces only, like Triangle::Intersect
+    bool Intersect(const Ray &r, double t_min, double t_max, double &t) const {
+        double dz = DotProduct(rows_[2], r.direction());
+        if (dz >= 0.0) {
+            return false;
+        }
+        t = -(DotProduct(rows_[2], r.origin()) + offsets_[2]) / dz;
+        if (t <= t_min || t >= t_max) {
+            return false;
+        }
+        double u = DotProduct(rows_[0], r.origin()) + offsets_[0] + t * DotProduct(rows_[0], r.direction());
+        if (u < 0.0 || u > 1.0) {
+            return false;
+        }
+        double v = DotProduct(rows_[1], r.origin()) + offsets_[1] + t * DotProduct(rows_[1], r.direction());
+        return v >= 0.0 && u + v <= 1.0;
+    }
+};
+
+// The per-ray half of the watertight test: the ray direction's dominant axis
+// becomes z, and a shear maps the direction onto it.
+struct WatertightRay {
+    int kx_ = 0, ky_ = 1, kz_ = 2;
+    double sx_ = 0.0, sy_ = 0.0, sz_ = 0.0;
+    // origin in the permuted axes
+    double ox_ = 0.0, oy_ = 0.0, oz_ = 0.0;
+
+    WatertightRay() {}
+    WatertightRay(const Ray &r) {
+        const Vector3d &d = r.direction();
+        kz_ = fabs(d.x()) > fabs(d.y()) ? (fabs(d.x()) > fabs(d.z()) ? 0 : 2) : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+        kx_ = (kz_ + 1) % 3;
+        ky_ = (kx_ + 1) % 3;
+        // keep the winding, so front faces keep their sign
+        if (d(kz_) < 0.0) {
+            std::swap(kx_, ky_);
+        }
+        sx_ = d(kx_) / d(kz_);
+        sy_ = d(ky_) / d(kz_);
+        sz_ = 1.0 / d(kz_);
+        ox_ = r.origin()(kx_);
+        oy_ = r.origin()(ky_);
+        oz_ = r.origin()(kz_);
+    }
+};
+
+struct WatertightTriangleRecord {
+    // vertex coordinates, vertex major
+    double coords_[3][3];
+
+    WatertightTriangleRecord() {}
+    WatertightTriangleRecord(const std::array<Point3d, 3> &v) {
+        for (int i = 0; i < 3; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                coords_[i][k] = v[i](k);
+            }
+        }
+    }
+
+    // front faces only, like Triangle::Intersect
+    bool Intersect(const WatertightRay &r, double t_min, double t_max, double &t) const {
+        // vertices relative to the origin, sheared so the ray runs along z
+        double az = coords_[0][r.kz_] - r.oz_, bz = coords_[1][r.kz_] - r.oz_, cz = coords_[2][r.kz_] - r.oz_;
+        double ax = coords_[0][r.kx_] - r.ox_ - r.sx_ * az, ay = coords_[0][r.ky_] - r.oy_ - r.sy_ * az;
+        double bx = coords_[1][r.kx_] - r.ox_ - r.sx_ * bz, by = coords_[1][r.ky_] - r.oy_ - r.sy_ * bz;
+        double cx = coords_[2][r.kx_] - r.ox_ - r.sx_ * cz, cy = coords_[2][r.ky_] - r.oy_ - r.sy_ * cz;
+        // scaled barycentrics: edge functions of the sheared triangle at the origin
+        double u = cx * by - cy * bx;
+        double v = ax * cy - ay * cx;
+        double w = bx * ay - by * ax;
+        if (u < 0.0 || v < 0.0 || w < 0.0) {
+            return false;
+        }
+        double det = u + v + w;
+        if (det == 0.0) {
+            return false;
+        }
+        double scaled_t = r.sz_ * (u * az + v * bz + w * cz);
+        if (scaled_t <= t_min * det || scaled_t >= t_max * det) {
+            return false;
+        }
+        t = scaled_t / det;
+        return true;
+    }
+};
+
+// The quad a pair of triangles a and b make up, with a's winding, if they share
+// an edge and together form a planar convex quad.
+bool MergeTrianglePair(const std::array<Vector3d, 3> &a, const std::array<Vector3d, 3> &b, std::array<Vector3d, 4> &quad) {
+    for (int k = 0; k < 3; ++k) {
+        // the edge from a[k + 1] to a[k + 2], run the other way in b
+        const Vector3d &x = a[k], &y = a[(k + 1) % 3], &z = a[(k + 2) % 3];
+        for (int m = 0; m < 3; ++m) {
+            if (b[m] == z && b[(m + 1) % 3] == y) {
+                quad = {x, y, b[(m + 2) % 3], z};
+                return Quad::IsPlanarConvex(quad);
+            }
+        }
+    }
+    return false;
+}
+
+// Faces of a mesh, triangles or, where two triangles in a row make up a planar
+// convex quad and keep_quads is set, Quads. OBJ quads come out of the loader as
+// such pairs. Given an arena, the faces are allocated from it, and the mesh
+// keeps the arena alive. A scene's BVH takes the faces one by one through
+// GetPrimitives; Intersect on the mesh itself tests every face and is only
+// meant for small meshes used on their own.
 class MeshTriangle : public Object {
 public:
-    MeshTriangle(const objl::Mesh &mesh, shared_ptr<Material> material) : material_(material) {
+    MeshTriangle(const objl::Mesh &mesh, MaterialId material, const std::shared_ptr<Arena> &arena = nullptr, bool keep_quads = true)
+        : arena_(arena), material_(material) {
         Vector3d min_vertex = Vector3d{infinity, infinity, infinity};
         Vector3d max_vertex = Vector3d{-infinity, -infinity, -infinity};
 
         surface_area_ = 0.0;
 
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
+        std::vector<std::array<Vector3d, 3>> triangles;
+        for (size_t i = 0; i + 2 < mesh.Indices.size(); i += 3) {
             std::array<Vector3d, 3> face_vertices;
             for (int j = 0; j < 3; ++j) {
-                Vector3d vertex = Vector3d(mesh.Vertices[i + j].Position.X,
-                                           mesh.Vertices[i + j].Position.Y,
-                                           mesh.Vertices[i + j].Position.Z);
+                const objl::Vertex &mesh_vertex = mesh.Vertices[mesh.Indices[i + j]];
+                Vector3d vertex = Vector3d(mesh_vertex.Position.X, mesh_vertex.Position.Y, mesh_vertex.Position.Z);
                 face_vertices[j] = vertex;
 
                 min_vertex = Vector3d(fmin(min_vertex.x(), vertex.x()), fmin(min_vertex.y(), vertex.y()), fmin(min_vertex.z(), vertex.z()));
                 max_vertex = Vector3d(fmax(max_vertex.x(), vertex.x()), fmax(max_vertex.y(), vertex.y()), fmax(max_vertex.z(), vertex.z()));
             }
+            triangles.push_back(face_vertices);
+        }
 
-            auto triangle_ptr = make_shared<Triangle>(face_vertices[0], face_vertices[1], face_vertices[2], material);
-            surface_area_ += triangle_ptr->GetArea();
-            triangles_.emplace_back(triangle_ptr);
+        for (size_t i = 0; i < triangles.size(); ++i) {
+            std::array<Vector3d, 4> quad;
+            ObjectPtrType face_ptr;
+            if (keep_quads && i + 1 < triangles.size() && MergeTrianglePair(triangles[i], triangles[i + 1], quad)) {
+                ++i;
+                face_ptr = NewFace<Quad>(arena, quad[0], quad[1], quad[2], quad[3], material);
+            } else {
+                face_ptr = NewFace<Triangle>(arena, triangles[i][0], triangles[i][1], triangles[i][2], material);
+            }
+            surface_area_ += face_ptr->GetArea();
+            faces_.emplace_back(face_ptr);
         }
 
         box_ = BoundingBox(min_vertex, max_vertex);
-
-        bvh_tree_ = Bvh::BvhTree(triangles_);
     }
 
     virtual Intersection Intersect(const Ray &r, double t_min, double t_max) const override;
     virtual BoundingBox GetBoundingBox() const override;
-    virtual void Sample(Intersection &inter, double &pdf) const override;
+    virtual void Sample(Intersection &inter, double &pdf, Sampler &sampler) const override;
 
     virtual double GetArea() const override { return surface_area_; }
-    virtual MaterialPtrType GetMaterial() const override { return material_; }
+    virtual MaterialId GetMaterial() const override { return material_; }
+
+    virtual void GetPrimitives(std::vector<const Object *> &primitives) const override {
+        for (const auto &face : faces_) {
+            primitives.push_back(face.get());
+        }
+    }
+
+private:
+    template <typename Face, typename... Args>
+    static ObjectPtrType NewFace(const std::shared_ptr<Arena> &arena, Args &&...args) {
+        if (arena) {
+            // shares the arena's reference count instead of getting its own
+            return ObjectPtrType(arena, arena->New<Face>(std::forward<Args>(args)...));
+        }
+        return make_shared<Face>(std::forward<Args>(args)...);
+    }
 
 public:
-    ObjectListType triangles_;
+    std::shared_ptr<Arena> arena_;
 
-    BoundingBox box_;
+    ObjectListType faces_;
 
-    Bvh::BvhTree bvh_tree_;
+    BoundingBox box_;
 
     double surface_area_;
 
-    MaterialPtrType material_;
+    MaterialId material_;
 };
 
 Intersection MeshTriangle::Intersect(const Ray &r, double t_min, double t_max) const {
-    return bvh_tree_.CheckIntersect(r, t_min, t_max);
+    Intersection ret_intersection;
+    for (const auto &face : faces_) {
+        Intersection cur_intersection = face->Intersect(r, t_min, t_max);
+        if (cur_intersection.happened_) {
+            t_max = cur_intersection.t_;
+            ret_intersection = cur_intersection;
+        }
+    }
+    return ret_intersection;
 }
 
 BoundingBox MeshTriangle::GetBoundingBox() const {
     return box_;
 }
 
-void MeshTriangle::Sample(Intersection &inter, double &pdf) const {
-    //bvh_tree_.Sample(inter, pdf);
-    double tmp_p = TrRandom::Double() * GetArea();
-    for (const auto &tri : triangles_) {
-        if (tri->GetArea() > tmp_p) {
-            tri->Sample(inter, pdf);
+void MeshTriangle::Sample(Intersection &inter, double &pdf, Sampler &sampler) const {
+    double tmp_p = sampler.Get1D() * GetArea();
+    for (const auto &face : faces_) {
+        if (face->GetArea() > tmp_p) {
+            face->Sample(inter, pdf, sampler);
+            // times the chance of picking this face
+            pdf *= face->GetArea() / GetArea();
             return;
         }
-        tmp_p -= tri->GetArea();
+        tmp_p -= face->GetArea();
     }
 }
 
-ObjectListType LoadObjectModel(std::string filename, shared_ptr<Material> material) {
+ObjectListType LoadObjectModel(std::string filename, MaterialId material, const std::shared_ptr<Arena> &arena = nullptr, bool keep_quads = true) {
     objl::Loader loader;
     loader.LoadFile(filename);
     auto meshes = loader.LoadedMeshes;
@@ -158,7 +425,7 @@ ObjectListType LoadObjectModel(std::string filename, shared_ptr<Material> materi
     ObjectListType mesh_list;
 
     for (auto &mesh : meshes) {
-        mesh_list.emplace_back(make_shared<MeshTriangle>(mesh, material));
+        mesh_list.emplace_back(make_shared<MeshTriangle>(mesh, material, arena, keep_quads));
     }
 
     return mesh_list;
@@ -0,0 +1,99 @@
+#ifndef TR_INCLUDE_TRIANGLE_PACKET_H
+#define TR_INCLUDE_TRIANGLE_PACKET_H
+
+#include <array>
+
+#include "base.hpp"
+#include "packet.hpp"
+
+// Up to kPacketWidth triangles in single precision, stored as structure of
+// arrays so one Möller-Trumbore test runs on all lanes at once.
+// Unused lanes are all zero, a degenerate triangle that is never hit.
+struct alignas(32) TrianglePacket {
+    // first vertex and the two edges from it, axis major
+    float vertices_[3][kPacketWidth];
+    float edges_[2][3][kPacketWidth];
+    // the triangle in lane 0; the other lanes hold the ones after it
+    int first_;
+
+    TrianglePacket() {}
+    TrianglePacket(int first) : vertices_(), edges_(), first_(first) {}
+
+    void Set(int lane, const std::array<Point3d, 3> &v) {
+        for (int k = 0; k < 3; ++k) {
+            vertices_[k][lane] = static_cast<float>(v[0](k));
+            edges_[0][k][lane] = static_cast<float>(v[1](k) - v[0](k));
+            edges_[1][k][lane] = static_cast<float>(v[2](k) - v[0](k));
+        }
+    }
+
+    // Lane of the nearest front face hit in (t_min, t_max), or -1. Sets t to
+    // its distance.
+    int Intersect(const PacketRay &r, float t_min, float t_max, float &t) const;
+};
+
+#if defined(__SSE2__)
+
+int TrianglePacket::Intersect(const PacketRay &r, float t_min, float t_max, float &t) const {
+    PacketFloat dx = PacketSet(r.direction_[0]), dy = PacketSet(r.direction_[1]), dz = PacketSet(r.direction_[2]);
+    PacketFloat e0x = PacketLoad(edges_[0][0]), e0y = PacketLoad(edges_[0][1]), e0z = PacketLoad(edges_[0][2]);
+    PacketFloat e1x = PacketLoad(edges_[1][0]), e1y = PacketLoad(edges_[1][1]), e1z = PacketLoad(edges_[1][2]);
+
+    // pvec = d x e1, det = e0 . pvec, positive for front faces
+    PacketFloat px = dy * e1z - dz * e1y, py = dz * e1x - dx * e1z, pz = dx * e1y - dy * e1x;
+    PacketFloat det = e0x * px + e0y * py + e0z * pz;
+    PacketFloat zero = PacketSet(0.0f), one = PacketSet(1.0f);
+    PacketFloat hit = PacketGreater(det, zero);
+    if (!PacketMask(hit)) {
+        return -1;
+    }
+    PacketFloat inv_det = one / det;
+
+    PacketFloat tx = PacketSet(r.origin_[0]) - PacketLoad(vertices_[0]);
+    PacketFloat ty = PacketSet(r.origin_[1]) - PacketLoad(vertices_[1]);
+    PacketFloat tz = PacketSet(r.origin_[2]) - PacketLoad(vertices_[2]);
+    PacketFloat u = (tx * px + ty * py + tz * pz) * inv_det;
+    // qvec = tvec x e0
+    PacketFloat qx = ty * e0z - tz * e0y, qy = tz * e0x - tx * e0z, qz = tx * e0y - ty * e0x;
+    PacketFloat v = (dx * qx + dy * qy + dz * qz) * inv_det;
+    PacketFloat t_lanes = (e1x * qx + e1y * qy + e1z * qz) * inv_det;
+    hit = PacketAnd(hit, PacketAnd(PacketGreaterEqual(u, zero), PacketGreaterEqual(v, zero)));
+    hit = PacketAnd(hit, PacketGreaterEqual(one, u + v));
+    hit = PacketAnd(hit, PacketAnd(PacketGreater(t_lanes, PacketSet(t_min)), PacketGreater(PacketSet(t_max), t_lanes)));
+
+    int nearest = PacketNearest(hit, t_lanes, t_max);
+    t = t_max;
+    return nearest;
+}
+
+#else
+
+int TrianglePacket::Intersect(const PacketRay &r, float t_min, float t_max, float &t) const {
+    const float *d = r.direction_;
+    int nearest = -1;
+    for (int lane = 0; lane < kPacketWidth; ++lane) {
+        float e0[3] = {edges_[0][0][lane], edges_[0][1][lane], edges_[0][2][lane]};
+        float e1[3] = {edges_[1][0][lane], edges_[1][1][lane], edges_[1][2][lane]};
+        float p[3] = {d[1] * e1[2] - d[2] * e1[1], d[2] * e1[0] - d[0] * e1[2], d[0] * e1[1] - d[1] * e1[0]};
+        float det = e0[0] * p[0] + e0[1] * p[1] + e0[2] * p[2];
+        if (!(det > 0.0f)) {
+            continue;
+        }
+        float inv_det = 1.0f / det;
+        float tv[3] = {r.origin_[0] - vertices_[0][lane], r.origin_[1] - vertices_[1][lane], r.origin_[2] - vertices_[2][lane]};
+        float u = (tv[0] * p[0] + tv[1] * p[1] + tv[2] * p[2]) * inv_det;
+        float q[3] = {tv[1] * e0[2] - tv[2] * e0[1], tv[2] * e0[0] - tv[0] * e0[2], tv[0] * e0[1] - tv[1] * e0[0]};
+        float v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inv_det;
+        float t_lane = (e1[0] * q[0] + e1[1] * q[1] + e1[2] * q[2]) * inv_det;
+        if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t_lane > t_min && t_lane < t_max) {
+            t_max = t_lane;
+            nearest = lane;
+        }
+    }
+    t = t_max;
+    return nearest;
+}
+
+#endif
+
+#endif
@@ -1,14 +1,173 @@
-#include "BVH.hpp"
+#include <string>
+
+#include "accumulation_buffer.hpp"
+#include "async_image_writer.hpp"
 #include "base.hpp"
 #include "camera.hpp"
+#include "checkpoint.hpp"
 #include "color.hpp"
+#include "denoiser.hpp"
+#include "image_writer.hpp"
 #include "object_list.hpp"
 #include "renderer.hpp"
+#include "sampler.hpp"
 #include "scene.hpp"
 #include "sphere.hpp"
 #include "traingle.hpp"
 
-int main() {
+// Replace the run of '#' in a pattern like "frame####.ppm" with the zero-padded
+// frame number, or append the number when there is none.
+std::string FrameFilename(const std::string &pattern, int frame) {
+    std::string number = std::to_string(frame);
+    size_t begin = pattern.find('#');
+    if (begin == std::string::npos) {
+        return pattern + number;
+    }
+    size_t end = pattern.find_first_not_of('#', begin);
+    size_t width = (end == std::string::npos ? pattern.size() : end) - begin;
+    if (number.size() < width) {
+        number.insert(0, width - number.size(), '0');
+    }
+    return pattern.substr(0, begin) + number + (end == std::string::npos ? "" : pattern.substr(end));
+}
+
+int main(int argc, char **argv) {
+    // Options
+    int samples_per_pixel = 32;
+    bool samples_given = false;
+    int sample_begin = 0;
+    std::string accum_filename;
+    bool denoise = false;
+    std::string output_filename;
+    ImageFormat format = kP6;
+    bool format_given = false;
+    int num_frames = 1;
+    int image_width = 400;
+    int max_depth = 0;
+    bool stream = false;
+    bool resume = false;
+    Sampler::SamplerType sampler_type = Sampler::kSOBOL;
+    MisHeuristic mis_heuristic = kPOWER;
+    double orbit_degrees = 20.0;
+    std::string environment_filename;
+    double environment_scale = 1.0;
+    std::string particles_filename;
+    bool keep_quads = true;
+    TriangleIntersector triangle_intersector = kWATERTIGHT;
+    ProgressiveSettings progressive;
+    progressive.samples_per_pass = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--spp" && i + 1 < argc) {
+            samples_per_pixel = std::stoi(argv[++i]);
+            samples_given = true;
+        } else if (arg == "--sample-begin" && i + 1 < argc) {
+            sample_begin = std::stoi(argv[++i]);
+        } else if (arg == "--accum" && i + 1 < argc) {
+            accum_filename = argv[++i];
+        } else if (arg == "--pass-spp" && i + 1 < argc) {
+            progressive.samples_per_pass = std::stoi(argv[++i]);
+        } else if (arg == "--preview" && i + 1 < argc) {
+            progressive.preview_filename = argv[++i];
+        } else if (arg == "--preview-passes" && i + 1 < argc) {
+            progressive.preview_interval_passes = std::stoi(argv[++i]);
+        } else if (arg == "--preview-seconds" && i + 1 < argc) {
+            progressive.preview_interval_seconds = std::stod(argv[++i]);
+        } else if (arg == "--time-budget" && i + 1 < argc) {
+            progressive.time_budget_seconds = std::stod(argv[++i]);
+        } else if (arg == "--output" && i + 1 < argc) {
+            output_filename = argv[++i];
+        } else if (arg == "--format" && i + 1 < argc && ParseImageFormat(argv[i + 1], format)) {
+            format_given = true;
+            ++i;
+        } else if (arg == "--frames" && i + 1 < argc) {
+            num_frames = std::stoi(argv[++i]);
+        } else if (arg == "--orbit-degrees" && i + 1 < argc) {
+            orbit_degrees = std::stod(argv[++i]);
+        } else if (arg == "--width" && i + 1 < argc) {
+            image_width = std::stoi(argv[++i]);
+        } else if (arg == "--max-depth" && i + 1 < argc) {
+            max_depth = std::stoi(argv[++i]);
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            progressive.checkpoint_filename = argv[++i];
+        } else if (arg == "--checkpoint-passes" && i + 1 < argc) {
+            progressive.checkpoint_interval_passes = std::stoi(argv[++i]);
+        } else if (arg == "--checkpoint-seconds" && i + 1 < argc) {
+            progressive.checkpoint_interval_seconds = std::stod(argv[++i]);
+        } else if (arg == "--resume") {
+            resume = true;
+        } else if (arg == "--sampler" && i + 1 < argc && ParseSamplerType(argv[i + 1], sampler_type)) {
+            ++i;
+        } else if (arg == "--mis" && i + 1 < argc && (std::string(argv[i + 1]) == "balance" || std::string(argv[i + 1]) == "power")) {
+            mis_heuristic = std::string(argv[++i]) == "balance" ? kBALANCE : kPOWER;
+        } else if (arg == "--envmap" && i + 1 < argc) {
+            environment_filename = argv[++i];
+        } else if (arg == "--envmap-scale" && i + 1 < argc) {
+            environment_scale = std::stod(argv[++i]);
+        } else if (arg == "--particles" && i + 1 < argc) {
+            particles_filename = argv[++i];
+        } else if (arg == "--triangulate") {
+            keep_quads = false;
+        } else if (arg == "--triangle-test" && i + 1 < argc && ParseTriangleIntersector(argv[i + 1], triangle_intersector)) {
+            ++i;
+        } else if (arg == "--stream") {
+            stream = true;
+        } else if (arg == "--denoise") {
+            denoise = true;
+        } else if (arg == "--adaptive" && i + 1 < argc) {
+            progressive.adaptive_threshold = std::stod(argv[++i]);
+        } else if (arg == "--adaptive-min-spp" && i + 1 < argc) {
+            progressive.adaptive_min_samples = std::stoi(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--spp N] [--sample-begin K] [--accum file]"
+                      << " [--output file] [--format p3|p6|qoi|pfm] [--width W] [--max-depth N] [--stream]"
+                      << " [--sampler random|stratified|halton|sobol|bluenoise] [--mis balance|power]"
+                      << " [--envmap file.pfm [--envmap-scale S]] [--particles file]"
+                      << " [--triangle-test moller|affine|watertight|simd] [--triangulate]"
+                      << " [--pass-spp N] [--preview file] [--preview-passes N] [--preview-seconds T]"
+                      << " [--time-budget T] [--adaptive threshold] [--adaptive-min-spp N] [--denoise]"
+                      << " [--checkpoint file [--checkpoint-passes N] [--checkpoint-seconds T] [--resume]]"
+                      << " [--frames N --output pattern#### [--orbit-degrees D]]\n";
+            return 1;
+        }
+    }
+    if (num_frames > 1 && (output_filename.empty() || !accum_filename.empty())) {
+        std::cerr << "--frames needs --output with a frame number pattern such as frame####.ppm\n";
+        return 1;
+    }
+    bool checkpointed = !progressive.checkpoint_filename.empty();
+    if (checkpointed && (num_frames > 1 || stream)) {
+        std::cerr << "--checkpoint applies to single frames that are not streamed\n";
+        return 1;
+    }
+    // a streamed frame is a single fixed range of samples with no buffer to keep
+    if (stream && (!samples_given || num_frames > 1 || !accum_filename.empty() || denoise || progressive.samples_per_pass > 0 ||
+                   !progressive.preview_filename.empty() || progressive.time_budget_seconds > 0.0 || progressive.adaptive_threshold > 0.0)) {
+        std::cerr << "--stream needs --spp and takes no --frames, --accum, --denoise, --pass-spp, --preview,"
+                  << " --time-budget or --adaptive\n";
+        return 1;
+    }
+    if (resume && !checkpointed) {
+        std::cerr << "--resume needs --checkpoint\n";
+        return 1;
+    }
+
+    // time budgets, adaptive sampling and checkpoints render progressively, and a
+    // time budget only treats --spp as an optional cap. Checkpoints are saved every
+    // five minutes unless an interval is given.
+    if (checkpointed && progressive.checkpoint_interval_passes == 0 && progressive.checkpoint_interval_seconds == 0.0) {
+        progressive.checkpoint_interval_seconds = 300.0;
+    }
+    if (progressive.time_budget_seconds > 0.0 || progressive.adaptive_threshold > 0.0 || checkpointed) {
+        if (progressive.samples_per_pass == 0) {
+            progressive.samples_per_pass = ProgressiveSettings().samples_per_pass;
+        }
+    }
+    if (progressive.time_budget_seconds > 0.0 && !samples_given) {
+        samples_per_pixel = 0;
+    }
+
     // Scene
     Scene scene;
 
@@ -22,30 +181,38 @@ int main() {
     //                                       Point3d(0.0, 1.0, -1.0),
     //                                           material_center));
 
-    auto red = make_shared<Material>(Material::kDIFFUSE, Vector3d(0.63, 0.065, 0.05), Vector3d(0, 0, 0), Vector3d(0, 0, 0), 0.0);
-    auto green = make_shared<Material>(Material::kDIFFUSE, Vector3d(0.14, 0.45, 0.091), Vector3d(0, 0, 0), Vector3d(0, 0, 0), 0.0);
-    auto white = make_shared<Material>(Material::kDIFFUSE, Vector3d(0.725, 0.71, 0.68), Vector3d(0, 0, 0), Vector3d(0, 0, 0), 0.0);
+    MaterialId red = scene.AddMaterial(Material(Material::kDIFFUSE, Vector3d(0.63, 0.065, 0.05), Vector3d(0, 0, 0), 0.0));
+    MaterialId green = scene.AddMaterial(Material(Material::kDIFFUSE, Vector3d(0.14, 0.45, 0.091), Vector3d(0, 0, 0), 0.0));
+    MaterialId white = scene.AddMaterial(Material(Material::kDIFFUSE, Vector3d(0.725, 0.71, 0.68), Vector3d(0, 0, 0), 0.0));
 
-    auto white_metal = make_shared<Material>(Material::kMICROFACET, Vector3d(0.725, 0.71, 0.68), Vector3d(0, 0, 0), Vector3d(0, 0, 0), 20.0, 0.08, 0.95);
+    MaterialId white_metal = scene.AddMaterial(Material(Material::kMICROFACET, Vector3d(0.725, 0.71, 0.68), Vector3d(0, 0, 0), 20.0, 0.08, 0.95));
 
-    auto light = make_shared<Material>(Material::kDIFFUSE, Vector3d(0.725, 0.71, 0.68), Vector3d(0, 0, 0),
-                                       (8.0 * Vector3d(0.747 + 0.058, 0.747 + 0.258, 0.747) + 15.6 * Vector3d(0.740 + 0.287, 0.740 + 0.160, 0.740) + 18.4 * Vector3d(0.737 + 0.642, 0.737 + 0.159, 0.737)), 0.0);
+    MaterialId light = scene.AddMaterial(Material(Material::kDIFFUSE, Vector3d(0.725, 0.71, 0.68),
+                                                  (8.0 * Vector3d(0.747 + 0.058, 0.747 + 0.258, 0.747) + 15.6 * Vector3d(0.740 + 0.287, 0.740 + 0.160, 0.740) + 18.4 * Vector3d(0.737 + 0.642, 0.737 + 0.159, 0.737)), 0.0));
 
-    auto list = LoadObjectModel("/home/polyethylene/toyRenderer/asset/cornellbox/floor.obj", white);
-    auto tmp = LoadObjectModel("/home/polyethylene/toyRenderer/asset/cornellbox/left.obj", red);
+    auto list = LoadObjectModel("/home/polyethylene/toyRenderer/asset/cornellbox/floor.obj", white, scene.GetArena(), keep_quads);
+    auto tmp = LoadObjectModel("/home/polyethylene/toyRenderer/asset/cornellbox/left.obj", red, scene.GetArena(), keep_quads);
     list.insert(list.end(), tmp.begin(), tmp.end());
-    tmp = LoadObjectModel("/home/polyethylene/toyRenderer/asset/cornellbox/right.obj", green);
+    tmp = LoadObjectModel("/home/polyethylene/toyRenderer/asset/cornellbox/right.obj", green, scene.GetArena(), keep_quads);
     list.insert(list.end(), tmp.begin(), tmp.end());
-    tmp = LoadObjectModel("/home/polyethylene/toyRenderer/asset/cornellbox/shortbox.obj", white);
+    tmp = LoadObjectModel("/home/polyethylene/toyRenderer/asset/cornellbox/shortbox.obj", white, scene.GetArena(), keep_quads);
     list.insert(list.end(), tmp.begin(), tmp.end());
-    tmp = LoadObjectModel("/home/polyethylene/toyRenderer/asset/cornellbox/tallbox.obj", white);
+    tmp = LoadObjectModel("/home/polyethylene/toyRenderer/asset/cornellbox/tallbox.obj", white, scene.GetArena(), keep_quads);
     list.insert(list.end(), tmp.begin(), tmp.end());
-    tmp = LoadObjectModel("/home/polyethylene/toyRenderer/asset/cornellbox/light.obj", light);
+    tmp = LoadObjectModel("/home/polyethylene/toyRenderer/asset/cornellbox/light.obj", light, scene.GetArena(), keep_quads);
     list.insert(list.end(), tmp.begin(), tmp.end());
 
     for (auto &elem : list) {
         scene.AddObject(elem);
     }
+    if (!particles_filename.empty()) {
+        ObjectPtrType particles;
+        if (!LoadSphereSet(particles_filename, white, scene.GetArena(), particles)) {
+            std::cerr << "Failed to read particles " << particles_filename << "\n";
+            return 1;
+        }
+        scene.AddObject(particles);
+    }
 
     // Camera
     Point3d view_point(278, 273, -550);
@@ -56,12 +223,120 @@ int main() {
     Camera cam(view_point, look_at_point, Vector3d(0, 1, 0), 50.0, aspect_ratio, 0.035, 0.0);
 
     scene.SetCamera(cam);
+    if (!environment_filename.empty()) {
+        EnvironmentLight environment;
+        if (!environment.Load(environment_filename, environment_scale)) {
+            std::cerr << "Failed to read environment map " << environment_filename << "\n";
+            return 1;
+        }
+        scene.SetEnvironment(environment);
+    }
+    scene.SetTriangleIntersector(triangle_intersector);
     scene.InitializeBvh();
     // Render
 
-    Renderer renderer(400, aspect_ratio, 32, 0);
-    renderer.Render(std::cout, scene);
+    Renderer renderer(image_width, aspect_ratio, samples_per_pixel, max_depth);
+    renderer.SetSamplerType(sampler_type);
+    renderer.SetMisHeuristic(mis_heuristic);
+
+    // Frames too large for memory are streamed band by band to a mapped file.
+    if (stream) {
+        ImageFormat stream_format = format_given ? format : ImageFormatFromFilename(output_filename);
+        if (output_filename.empty() || (stream_format != kP6 && stream_format != kPFM)) {
+            std::cerr << "--stream needs --output with a P6 or PFM file\n";
+            return 1;
+        }
+        if (!renderer.RenderStreaming(output_filename, scene, sample_begin, stream_format)) {
+            std::cerr << "\nFailed to write " << output_filename << "\n";
+            return 1;
+        }
+        std::cerr << "\nDone.\n";
+        return 0;
+    }
+
+    const RenderCheckpoint *resume_from = nullptr;
+    auto render_frame = [&](AccumulationBuffer &buffer) {
+        if (progressive.samples_per_pass > 0) {
+            RenderStats stats = renderer.RenderProgressive(buffer, scene, sample_begin, samples_per_pixel, progressive, resume_from);
+            std::cerr << "\nRendered " << stats.samples_per_pixel_ << " spp (" << stats.average_samples_per_pixel_
+                      << " on average) in " << stats.passes_ << " passes, " << stats.seconds_ << " s\n";
+        } else {
+            renderer.RenderSamples(buffer, scene, sample_begin, samples_per_pixel);
+        }
+    };
+
+    // An animation orbits the camera around the look-at point. Finished frames go
+    // to a background writer, so denoising, encoding and disk I/O of one frame
+    // overlap rendering of the next.
+    if (num_frames > 1) {
+        AsyncImageWriter writer;
+        Vector3d offset = view_point - look_at_point;
+        for (int frame = 0; frame < num_frames; ++frame) {
+            double angle = DegreesToRadians(orbit_degrees * (static_cast<double>(frame) / (num_frames - 1) - 0.5));
+            Vector3d rotated(offset.x() * cos(angle) - offset.z() * sin(angle), offset.y(), offset.x() * sin(angle) + offset.z() * cos(angle));
+            scene.SetCamera(Camera(look_at_point + rotated, look_at_point, Vector3d(0, 1, 0), 50.0, aspect_ratio, 0.035, 0.0));
 
+            AccumulationBuffer buffer = writer.AcquireBuffer(renderer.ImageWidth(), renderer.ImageHeight());
+            render_frame(buffer);
+            std::string filename = FrameFilename(output_filename, frame);
+            writer.Submit(filename, std::move(buffer), format_given ? format : ImageFormatFromFilename(filename), denoise);
+        }
+        if (!writer.Finish()) {
+            return 1;
+        }
+        std::cerr << "\nDone.\n";
+        return 0;
+    }
+
+    // samples [sample_begin, sample_begin + spp) either go to an accumulation file
+    // for merging with other ranges, or straight to a tone-mapped image
+    AccumulationBuffer buffer(renderer.ImageWidth(), renderer.ImageHeight());
+
+    // A missing checkpoint means the run died before saving one, so it starts
+    // over; one saved by a different command line is refused.
+    RenderCheckpoint checkpoint;
+    if (resume && std::ifstream(progressive.checkpoint_filename)) {
+        AccumulationBuffer saved;
+        if (!LoadCheckpoint(progressive.checkpoint_filename, checkpoint, saved)) {
+            std::cerr << "Failed to read checkpoint " << progressive.checkpoint_filename << "\n";
+            return 1;
+        }
+        RenderCheckpoint expected = renderer.CheckpointSettings(sample_begin, samples_per_pixel, progressive);
+        if (saved.Width() != buffer.Width() || saved.Height() != buffer.Height() || !checkpoint.SameSettings(expected)) {
+            std::cerr << "Checkpoint " << progressive.checkpoint_filename << " was saved with different render settings\n";
+            return 1;
+        }
+        buffer = std::move(saved);
+        resume_from = &checkpoint;
+        std::cerr << "Resuming at sample " << checkpoint.next_sample_ << " after " << checkpoint.passes_ << " passes\n";
+    }
+    render_frame(buffer);
+    if (!accum_filename.empty()) {
+        if (!buffer.Save(accum_filename)) {
+            std::cerr << "\nFailed to write " << accum_filename << "\n";
+            return 1;
+        }
+    } else {
+        // denoising replaces the radiance sums, so accumulation files stay noisy
+        // and are denoised by the merge tool instead
+        if (denoise) {
+            Denoiser().Denoise(buffer);
+        }
+        // files take their format from the extension unless --format is given
+        if (!output_filename.empty()) {
+            if (!WriteImageFile(output_filename, buffer, format_given ? format : ImageFormatFromFilename(output_filename))) {
+                std::cerr << "\nFailed to write " << output_filename << "\n";
+                return 1;
+            }
+        } else {
+            WriteImage(std::cout, buffer, format);
+        }
+    }
+
+    // the finished frame supersedes the checkpoint
+    if (checkpointed) {
+        std::remove(progressive.checkpoint_filename.c_str());
+    }
     std::cerr << "\nDone.\n";
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,60 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "accumulation_buffer.hpp"
+#include "denoiser.hpp"
+#include "image_writer.hpp"
+
+// Merge accumulation files holding disjoint sample ranges of the same frame and
+// write the tone-mapped result to stdout. The merged buffer can also be saved, so
+// more samples can be added to a finished frame later.
+int main(int argc, char **argv) {
+    std::string output_filename;
+    std::vector<std::string> input_filenames;
+    bool denoise = false;
+    ImageFormat format = kP6;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc) {
+            output_filename = argv[++i];
+        } else if (arg == "--format" && i + 1 < argc && ParseImageFormat(argv[i + 1], format)) {
+            ++i;
+        } else if (arg == "--denoise") {
+            denoise = true;
+        } else {
+            input_filenames.emplace_back(arg);
+        }
+    }
+
+    if (input_filenames.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [-o merged_file] [--format p3|p6|qoi|pfm] [--denoise] file...\n";
+        return 1;
+    }
+
+    AccumulationBuffer merged;
+    for (const auto &filename : input_filenames) {
+        AccumulationBuffer part;
+        if (!part.Load(filename)) {
+            std::cerr << "Failed to read " << filename << "\n";
+            return 1;
+        }
+        if (merged.width_ == 0) {
+            merged = part;
+        } else if (!merged.Merge(part)) {
+            std::cerr << filename << " does not match the frame size or overlaps a merged sample range\n";
+            return 1;
+        }
+    }
+
+    if (!output_filename.empty() && !merged.Save(output_filename)) {
+        std::cerr << "Failed to write " << output_filename << "\n";
+        return 1;
+    }
+    if (denoise) {
+        Denoiser().Denoise(merged);
+    }
+    WriteImage(std::cout, merged, format);
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "accumulation_buffer.hpp"
+#include "camera.hpp"
+#include "environment_light.hpp"
+#include "parallel.hpp"
+#include "renderer.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "sphere.hpp"
+#include "traingle.hpp"
+
+// Every heap allocation in the process goes through these, so a render pass
+// can be checked to allocate nothing once the caches it fills on first use
+// (such as the blue-noise mask) are warm.
+static std::atomic<long> allocations(0);
+
+void *operator new(std::size_t size) {
+    ++allocations;
+    void *p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    ++allocations;
+    size_t align = static_cast<size_t>(alignment);
+    void *p = std::aligned_alloc(align, (size + align - 1) / align * align);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+const int image_size = 32;
+const int samples_per_pass = 2;
+
+// A box of quads loaded from OBJ with an emissive quad in its ceiling, loose
+// triangles, a sphere set and a tiny environment map, so every primitive type
+// and light sampling path is traced.
+bool BuildScene(Scene &scene, const std::string &obj_filename, const std::string &environment_filename) {
+    {
+        std::ofstream obj(obj_filename);
+        obj << "v 0 0 0\nv 1 0 0\nv 1 0 1\nv 0 0 1\nv 0 1 0\nv 1 1 0\nv 1 1 1\nv 0 1 1\n"
+            << "f 1 2 3 4\nf 1 4 8 5\nf 2 6 7 3\nf 4 3 7 8\nf 5 8 7 6\n";
+        std::ofstream light(obj_filename + ".light.obj");
+        light << "v 0.4 0.99 0.4\nv 0.6 0.99 0.4\nv 0.6 0.99 0.6\nv 0.4 0.99 0.6\nf 1 2 3 4\n";
+        std::ofstream environment(environment_filename, std::ios::binary);
+        environment << "PF\n4 2\n-1.0\n";
+        for (int i = 0; i < 4 * 2 * 3; ++i) {
+            float value = 0.1f * (i % 5);
+            environment.write(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+    }
+
+    MaterialId white = scene.AddMaterial(Material(Material::kDIFFUSE, Vector3d(0.7, 0.7, 0.7), Vector3d(0, 0, 0), 0.0));
+    MaterialId metal = scene.AddMaterial(Material(Material::kMICROFACET, Vector3d(0.7, 0.7, 0.7), Vector3d(0, 0, 0), 20.0, 0.1, 0.9));
+    MaterialId light = scene.AddMaterial(Material(Material::kDIFFUSE, Vector3d(0.7, 0.7, 0.7), Vector3d(20, 20, 20), 0.0));
+
+    scene.AddObject(LoadObjectModel(obj_filename, white, scene.GetArena()));
+    scene.AddObject(LoadObjectModel(obj_filename + ".light.obj", light, scene.GetArena()));
+    scene.AddObject(std::make_shared<Triangle>(Point3d(0.1, 0.01, 0.2), Point3d(0.5, 0.01, 0.2), Point3d(0.3, 0.4, 0.3), metal));
+    scene.AddObject(std::make_shared<SphereSet>(std::vector<Point3d>{Point3d(0.7, 0.2, 0.5), Point3d(0.3, 0.15, 0.7)},
+                                                std::vector<double>{0.15, 0.1}, std::vector<MaterialId>{metal, white}, scene.GetArena()));
+
+    EnvironmentLight environment;
+    if (!environment.Load(environment_filename)) {
+        return false;
+    }
+    scene.SetEnvironment(environment);
+    scene.SetCamera(Camera(Point3d(0.5, 0.5, -1.5), Point3d(0.5, 0.5, 0), Vector3d(0, 1, 0), 50.0, 1.0, 1.0, 0.0));
+    return true;
+}
+
+int main() {
+    const std::string obj_filename = "alloc_test_box.obj";
+    const std::string environment_filename = "alloc_test_environment.pfm";
+    Scene scene;
+    bool built = BuildScene(scene, obj_filename, environment_filename);
+    std::remove(obj_filename.c_str());
+    std::remove((obj_filename + ".light.obj").c_str());
+    std::remove(environment_filename.c_str());
+    if (!built) {
+        std::cerr << "Failed to build the test scene\n";
+        return 1;
+    }
+
+    // worker threads allocate when they start, so passes run on this thread
+    TrParallel::ThreadLimit() = 1;
+    int failures = 0;
+    for (TriangleIntersector intersector : {kMOLLER_TRUMBORE, kAFFINE, kWATERTIGHT, kSIMD}) {
+        scene.SetTriangleIntersector(intersector);
+        scene.InitializeBvh();
+        for (int type = Sampler::kRANDOM; type <= Sampler::kBLUE_NOISE; ++type) {
+            Renderer renderer(image_size, 1.0, 2 * samples_per_pass, 0);
+            renderer.SetSamplerType(static_cast<Sampler::SamplerType>(type));
+            AccumulationBuffer buffer(renderer.ImageWidth(), renderer.ImageHeight());
+
+            renderer.RenderSamples(buffer, scene, 0, samples_per_pass);
+            long before = allocations;
+            renderer.RenderSamples(buffer, scene, samples_per_pass, samples_per_pass);
+            long count = allocations - before;
+            if (count != 0) {
+                std::cerr << "\nintersector " << intersector << ", sampler " << type << ": " << count
+                          << " allocations after warm-up\n";
+                ++failures;
+            }
+        }
+    }
+    if (failures) {
+        return 1;
+    }
+    std::cerr << "\nNo allocations after warm-up\n";
+    return 0;
+}
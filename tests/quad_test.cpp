@@ -0,0 +1,107 @@
+#include <array>
+#include <cmath>
+#include <iostream>
+
+#include "quad.hpp"
+#include "sampler.hpp"
+
+const int num_quads = 200;
+const int samples_per_quad = 200;
+
+// Corners of a curved patch over [0, 4] x [0, 4] with the given heights, so
+// its front faces +z.
+std::array<Point3d, 4> PatchCorners(double h0, double h1, double h2, double h3) {
+    return {Point3d(0, 0, h0), Point3d(4, 0, h1), Point3d(4, 4, h2), Point3d(0, 4, h3)};
+}
+
+Point3d PatchPoint(const std::array<Point3d, 4> &v, double u, double w) {
+    return (1 - u) * (1 - w) * v[0] + u * (1 - w) * v[1] + u * w * v[2] + (1 - u) * w * v[3];
+}
+
+// A ray down onto P(u, v) along the patch normal there must hit P(u, v) itself.
+int CheckPatchHits(const Quad &quad, Sampler &sampler) {
+    int failures = 0;
+    const std::array<Point3d, 4> &v = quad.GetVertices();
+    for (int s = 0; s < samples_per_quad; ++s) {
+        Vector2d uv = sampler.Get2D();
+        Point3d p = PatchPoint(v, uv.x(), uv.y());
+        Vector3d dpdu = (1 - uv.y()) * (v[1] - v[0]) + uv.y() * (v[2] - v[3]);
+        Vector3d dpdv = (1 - uv.x()) * (v[3] - v[0]) + uv.x() * (v[2] - v[1]);
+        Vector3d n = Normalize(CrossProduct(dpdu, dpdv));
+        Intersection hit = quad.Intersect(Ray(p + 0.01 * n, -n), 0.0, infinity);
+        if (!hit.happened_ || Length(hit.p_ - p) > 1e-9 || DotProduct(hit.normal_, n) < 1 - 1e-9) {
+            ++failures;
+        }
+    }
+    return failures;
+}
+
+// Every point Sample(ref, ...) returns that ref sees from the front must get
+// the same pdf back from Pdf.
+int CheckSamplePdf(const Quad &quad, const Point3d &ref, Sampler &sampler) {
+    int failures = 0;
+    for (int s = 0; s < samples_per_quad; ++s) {
+        Intersection inter;
+        double pdf;
+        quad.Sample(ref, inter, pdf, sampler);
+        if (!(pdf > 0.0)) {
+            ++failures;
+            continue;
+        }
+        Intersection hit = quad.Intersect(Ray(ref, inter.p_ - ref), 0.0, infinity);
+        if (hit.happened_ && Length(hit.p_ - inter.p_) < 1e-9 && fabs(quad.Pdf(ref, inter.p_) - pdf) > 1e-9 * pdf) {
+            ++failures;
+        }
+    }
+    return failures;
+}
+
+int main() {
+    Sampler sampler(Sampler::kRANDOM, 0);
+    sampler.StartSample(0, 0, 0, 0);
+    int failures = 0;
+    double area_error = 0.0;
+    for (int i = 0; i < num_quads; ++i) {
+        Vector2d h01 = sampler.Get2D(), h23 = sampler.Get2D();
+        std::array<Point3d, 4> v = PatchCorners(2 * h01.x(), -2 * h01.y(), 2 * h23.x(), -2 * h23.y());
+        Quad quad(v[0], v[1], v[2], v[3], 0);
+        if (quad.IsPlanar() || Quad::IsPlanarConvex(v)) {
+            std::cerr << "patch " << i << " taken for a planar quad\n";
+            ++failures;
+            continue;
+        }
+        failures += CheckPatchHits(quad, sampler);
+        failures += CheckSamplePdf(quad, Point3d(2, 2, 6), sampler);
+
+        // uniform in uv, so the mean of 1 / pdf estimates the area
+        double inverse_pdf_sum = 0.0;
+        for (int s = 0; s < samples_per_quad; ++s) {
+            Intersection inter;
+            double pdf;
+            quad.Sample(inter, pdf, sampler);
+            inverse_pdf_sum += 1.0 / pdf;
+        }
+        area_error += inverse_pdf_sum / samples_per_quad / quad.GetArea() - 1.0;
+    }
+    // the patches are mildly curved, so 1 / pdf varies little about the area
+    if (fabs(area_error / num_quads) > 0.01) {
+        std::cerr << "patch 1 / pdf averages " << 1.0 + area_error / num_quads << " of the area\n";
+        ++failures;
+    }
+
+    // a planar convex quad passes, and takes solid angle samples from the front
+    std::array<Point3d, 4> flat = PatchCorners(0, 0, 0, 0);
+    Quad quad(flat[0], flat[1], flat[2], flat[3], 0);
+    if (!Quad::IsPlanarConvex(flat)) {
+        std::cerr << "planar quad rejected\n";
+        ++failures;
+    }
+    failures += CheckSamplePdf(quad, Point3d(1, 3, 2), sampler);
+
+    if (failures) {
+        std::cerr << failures << " quad checks failed\n";
+        return 1;
+    }
+    std::cerr << "Quad patch hits, samples and pdfs agree\n";
+    return 0;
+}